@@ -0,0 +1,82 @@
+#include "Test.hpp"
+#include "../Unconventional.hpp"
+
+int32_t __declspec(naked) Add_Distinctive(/*int32_t a, int32_t b*/)
+{
+	__asm
+	{
+		mov eax, [esp + 4]
+		add eax, [esp + 8]
+		xor eax, 0x5A5A5A5A
+		xor eax, 0x5A5A5A5A
+		ret
+	}
+}
+
+namespace AddressCacheTests
+{
+	using namespace Unconventional;
+
+	void Run()
+	{
+		char tempPath[MAX_PATH];
+		GetTempPathA(MAX_PATH, tempPath);
+		const std::string cachePath = std::string(tempPath) + "Unconventional_AddressCacheTests.bin";
+		DeleteFileA(cachePath.c_str());
+
+		const Pattern pattern("8B 44 24 04 03 44 24 08 35 5A 5A 5A 5A 35 ? ? ? ? C3");
+		const auto module = GetModuleHandleA(nullptr);
+
+		{
+			AddressCache cache(cachePath);
+			const auto address = cache.Resolve(module, pattern);
+			assert(address == (uintptr_t)&Add_Distinctive);
+			assert(cache.GetStatistics().misses == 1);
+
+			Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> function(address);
+			assert(function.Call(5, 3) == 8);
+
+			cache.Save();
+		}
+
+		{
+			AddressCache cache(cachePath);
+			assert(cache.Resolve(module, pattern) == (uintptr_t)&Add_Distinctive);
+			assert(cache.GetStatistics().hits == 1);
+			assert(cache.GetStatistics().misses == 0);
+		}
+
+		// A corrupted rva pointing past the image must be rescanned instead of read
+		{
+			std::fstream file(cachePath, std::ios::binary | std::ios::in | std::ios::out);
+			const uint32_t corruptedRva = 0xFFFFFFF0;
+			file.seekp(16 + 28);
+			file.write((const char*)&corruptedRva, sizeof(corruptedRva));
+		}
+
+		{
+			AddressCache cache(cachePath);
+			assert(cache.Resolve(module, pattern) == (uintptr_t)&Add_Distinctive);
+			assert(cache.GetStatistics().hits == 0);
+			assert(cache.GetStatistics().misses == 1);
+		}
+
+		bool threw = false;
+		try
+		{
+			Pattern("8 BB");
+		}
+		catch (const std::invalid_argument&)
+		{
+			threw = true;
+		}
+		assert(threw);
+
+		DeleteFileA(cachePath.c_str());
+	}
+}
+
+void RunAddressCacheTests()
+{
+	AddressCacheTests::Run();
+}
@@ -23,6 +23,11 @@ uint32_t testHook(uint32_t a, uint32_t b)
 	return hook.CallOriginalFunction(a, b);
 }
 
+uint32_t __cdecl MultiplyCallback(uint32_t a, uint32_t b)
+{
+	return a * b;
+}
+
 void RunBenchmark()
 {
 
@@ -82,4 +87,35 @@ void RunBenchmark()
 	std::cout << std::fixed << std::setprecision(6) << "Hooked Call: " << hookedTime << std::endl;
 	std::cout << std::fixed << std::setprecision(6) << "Unhooked Call: " << unhookedTime << std::endl;
 	std::cout << std::fixed << std::setprecision(6) << (hookedTime / unhookedTime) << "x" << std::endl;
+
+	Callback<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::ESI>, uint32_t, uint32_t, uint32_t> callback(&MultiplyCallback);
+	uintptr_t thunkAddress = callback.GetAddress();
+	MEASURE_START(callbackThunk);
+	for (int i = 0; i < ITERATIONS; i++)
+	{
+		__asm
+		{
+			mov eax, i
+			mov esi, 2
+			call thunkAddress
+		}
+	}
+	auto callbackTime = MEASURE_END(callbackThunk);
+
+	MEASURE_START(directCallback);
+	for (int i = 0; i < ITERATIONS; i++)
+	{
+		__asm
+		{
+			push 2
+			push i
+			call MultiplyCallback
+			add esp, 8
+		}
+	}
+	auto directCallbackTime = MEASURE_END(directCallback);
+
+	std::cout << std::fixed << std::setprecision(6) << "Callback Thunk Call: " << callbackTime << std::endl;
+	std::cout << std::fixed << std::setprecision(6) << "Direct Callback Call: " << directCallbackTime << std::endl;
+	std::cout << std::fixed << std::setprecision(6) << (callbackTime / directCallbackTime) << "x" << std::endl;
 }
\ No newline at end of file
@@ -83,8 +83,160 @@ namespace FloatSubtractionTests
 	}
 }
 
+namespace RuntimeSignatureTests
+{
+	using namespace Unconventional;
+
+	bool IsRejected(const std::string& prototype)
+	{
+		try
+		{
+			RuntimeSignature::Parse(prototype);
+		}
+		catch (const std::invalid_argument&)
+		{
+			return true;
+		}
+		return false;
+	}
+
+	uint32_t ToWord(float x)
+	{
+		return *(uint32_t*)&x;
+	}
+
+	void Run()
+	{
+		{
+			const auto signature = RuntimeSignature::Parse("int __usercall f@<eax>(int a@<eax>, int b)");
+			assert((signature.GetArgumentLocations() == std::vector<Location>{ Location::EAX, Location::Stack }));
+			assert(signature.GetReturnValueLocation() == Location::EAX);
+		}
+
+		{
+			const auto signature = RuntimeSignature::Parse("char *__usercall g@<esi>(int a@<ebx>, const char *b@<edi>, unsigned int c);");
+			assert((signature.GetArgumentLocations() == std::vector<Location>{ Location::EBX, Location::EDI, Location::Stack }));
+			assert(signature.GetReturnValueLocation() == Location::ESI);
+		}
+
+		{
+			const auto signature = RuntimeSignature::Parse("float __cdecl h(float x, float y)");
+			assert(signature.GetStackArgumentCount() == 2);
+			assert(signature.GetReturnValueLocation() == Location::ST0 && signature.ReturnsFloat());
+		}
+
+		assert(RuntimeSignature::Parse("void f(void)").GetArgumentLocations().empty());
+		assert(IsRejected("int __stdcall f(int a)"));
+		assert(IsRejected("double f(int a)"));
+		assert(IsRejected("int __usercall f@<eax>(short a@<ax>)"));
+		assert(IsRejected("int f(int a, ...)"));
+
+		{
+			const RuntimeFunction function((uintptr_t)&IntegerSubtractionTests::Subtract_ArgumentsStackOnly, RuntimeSignature::Parse("int f(int x, int y)"));
+			assert((int32_t)function.Call({ 5, 3 }) == 2);
+		}
+
+		{
+			const RuntimeFunction function((uintptr_t)&IntegerSubtractionTests::Subtract_ArgumentsRegistersOnly, RuntimeSignature::Parse("int __usercall f@<eax>(int x@<eax>, int y@<ebx>)"));
+			assert((int32_t)function.Call({ 5, 3 }) == 2);
+		}
+
+		{
+			const RuntimeFunction function((uintptr_t)&IntegerSubtractionTests::Subtract_ArgumentsMixed, RuntimeSignature::Parse("int __usercall f@<eax>(int x@<eax>, int y)"));
+			assert((int32_t)function.Call({ 5, 3 }) == 2);
+		}
+
+		{
+			const RuntimeFunction function((uintptr_t)&FloatSubtractionTests::FloatSubtract, RuntimeSignature::Parse("float f(float x, float y)"));
+			assert(abs(function.Call<float>({ ToWord(5), ToWord(3) }) - 2.0f) < 0.001f);
+		}
+	}
+}
+
+namespace CallbackTests
+{
+	using namespace Unconventional;
+
+	int32_t __cdecl Subtract(int32_t a, int32_t b)
+	{
+		return a - b;
+	}
+
+	int32_t __cdecl Digits(int32_t a, int32_t b, int32_t c)
+	{
+		return a * 100 + b * 10 + c;
+	}
+
+	float __cdecl FloatSubtract(float a, float b)
+	{
+		return a - b;
+	}
+
+	// Clobbers ecx and edx, as any cdecl function may
+	int32_t __cdecl ClobberingSubtract(int32_t a, int32_t b)
+	{
+		__asm
+		{
+			mov ecx, 0xDEAD
+			mov edx, 0xDEAD
+		}
+		return a - b;
+	}
+
+	// A __usercall caller may keep values in registers that are neither arguments nor the return location
+	void RunPreservedRegisters()
+	{
+		Callback<FunctionSignature<CallingConvention::Cdecl, Location::ESI, Location::EAX, Location::EBX>, int32_t, int32_t, int32_t> callback(&ClobberingSubtract);
+		const auto address = callback.GetAddress();
+
+		int32_t result = 0;
+		uint32_t ecxAfterCall = 0;
+		uint32_t edxAfterCall = 0;
+		__asm
+		{
+			push ebx
+			push esi
+			mov eax, 10
+			mov ebx, 3
+			mov ecx, 0x1111
+			mov edx, 0x2222
+			call address
+			mov result, esi
+			mov ecxAfterCall, ecx
+			mov edxAfterCall, edx
+			pop esi
+			pop ebx
+		}
+
+		assert(result == 7);
+		assert(ecxAfterCall == 0x1111 && edxAfterCall == 0x2222);
+	}
+
+	void Run()
+	{
+		{
+			Callback<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::ESI>, int32_t, int32_t, int32_t> callback(&Subtract);
+			assert(callback.AsFunction().Call(10, 3) == 7);
+		}
+
+		{
+			Callback<FunctionSignature<CallingConvention::Cdecl, Location::ESI, Location::Stack, Location::EDI, Location::Stack>, int32_t, int32_t, int32_t, int32_t> callback(&Digits);
+			assert(callback.AsFunction().Call(1, 2, 3) == 123);
+		}
+
+		{
+			Callback<FunctionSignature<CallingConvention::Cdecl, Location::ST0, Location::Stack, Location::Stack>, float, float, float> callback(&FloatSubtract);
+			assert(abs(callback.AsFunction().Call(5, 3) - 2.0f) < 0.001f);
+		}
+
+		RunPreservedRegisters();
+	}
+}
+
 void RunFunctionCallingTests()
 {
 	IntegerSubtractionTests::Run();
 	FloatSubtractionTests::Run();
+	RuntimeSignatureTests::Run();
+	CallbackTests::Run();
 }
\ No newline at end of file
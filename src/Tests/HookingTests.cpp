@@ -1,4 +1,9 @@
 #include <cassert>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
 
 #include "../Unconventional.hpp"
 
@@ -38,6 +43,113 @@ void __declspec(naked) Subtract_ArgumentsMixed(/*int32_t<eax> a, int32_t b*/)
 }
 
 
+void __declspec(naked) Add_ArgumentsStackOnly(/*int32_t a, int32_t b*/)
+{
+	__asm
+	{
+		mov eax, [esp + 4]
+		add eax, [esp + 8]
+		ret
+	}
+}
+
+uint32_t squareCallCount = 0;
+
+void __declspec(naked) Square_Counted(/*int32_t<eax> x*/)
+{
+	__asm
+	{
+		nop
+		nop
+		nop
+		nop
+		nop
+		inc squareCallCount
+		imul eax, eax
+		ret
+	}
+}
+
+void __declspec(naked) Countdown(/*int32_t<eax> n*/)
+{
+	__asm
+	{
+		push ebx
+		mov ebx, eax
+		nop
+		nop
+		xor eax, eax
+		test ebx, ebx
+		jz done
+		lea eax, [ebx - 1]
+		call Countdown
+		inc eax
+	done:
+		pop ebx
+		ret
+	}
+}
+
+void __declspec(naked) Triple(/*int32_t<eax> x*/)
+{
+	__asm
+	{
+		lea eax, [eax + eax * 2]
+		nop
+		nop
+		ret
+	}
+}
+
+// Five bytes of data in the code that look like a call once the displacement is filled in at runtime
+void __declspec(naked) FakeCallToTriple()
+{
+	__asm
+	{
+		jmp done
+		_emit 0xE8
+		_emit 0x00
+		_emit 0x00
+		_emit 0x00
+		_emit 0x00
+	done:
+		ret
+	}
+}
+
+void __declspec(naked) TailCallTriple(/*int32_t<eax> x*/)
+{
+	__asm
+	{
+		inc eax
+		nop
+		nop
+		nop
+		nop
+		jmp Triple
+	}
+}
+
+void __declspec(naked) CallCallback(/*void(*callback)()*/)
+{
+	__asm
+	{
+		mov eax, [esp + 4]
+		nop
+		call eax
+		ret
+	}
+}
+
+void __declspec(naked) CallTriplePlusOne(/*int32_t<eax> x*/)
+{
+	__asm
+	{
+		call Triple
+		inc eax
+		ret
+	}
+}
 
 namespace BasicRedirectionTests
 {
@@ -259,9 +371,741 @@ namespace TrampolineTests
 	}
 }
 
+namespace MoveTests
+{
+	using namespace Unconventional;
+
+	int32_t Subtract_Hook(int32_t a, int32_t b)
+	{
+		return b - a;
+	}
+
+	void Run()
+	{
+		using HookType = Hook<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t>;
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> function((uintptr_t)&Subtract_ArgumentsStackOnly);
+
+		std::vector<HookType> hooks;
+		hooks.push_back(HookType(function, (uintptr_t)&Subtract_Hook, 8));
+		hooks[0].Install();
+
+		// Growing the vector moves the installed hook around
+		for (int i = 0; i < 16; i++)
+		{
+			hooks.emplace_back();
+		}
+		assert(function.Call(10, 8) == -2);
+
+		HookType movedHook = std::move(hooks[0]);
+		hooks.clear();
+		assert(function.Call(10, 8) == -2);
+
+		movedHook.Uninstall();
+		assert(function.Call(10, 8) == 2);
+	}
+}
+
+namespace SharedWrapperTests
+{
+	using namespace Unconventional;
+
+	int32_t Subtract_Hook(int32_t a, int32_t b)
+	{
+		return b - a;
+	}
+
+	int32_t Add_Hook(int32_t a, int32_t b)
+	{
+		return a + b + 1000;
+	}
+
+	void Run()
+	{
+		// Both hooks share one wrapper, and only differ in the context their entry stubs pass to it
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> subtract((uintptr_t)&Subtract_ArgumentsStackOnly);
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> add((uintptr_t)&Add_ArgumentsStackOnly);
+
+		Hook subtractHook(subtract, (uintptr_t)&Subtract_Hook, 8);
+		Hook addHook(add, (uintptr_t)&Add_Hook, 8);
+		subtractHook.Install();
+		addHook.Install();
+
+		assert(subtract.Call(10, 8) == -2);
+		assert(add.Call(10, 8) == 1018);
+
+		subtractHook.Uninstall();
+		assert(subtract.Call(10, 8) == 2);
+		assert(add.Call(10, 8) == 1018);
+
+		addHook.Uninstall();
+		assert(add.Call(10, 8) == 18);
+	}
+}
+
+namespace BypassTests
+{
+	using namespace Unconventional;
+
+	int32_t Subtract_Hook(int32_t a, int32_t b)
+	{
+		return b - a;
+	}
+
+	int32_t CallOnOtherThread(Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::EBX>, int32_t, int32_t, int32_t>& function)
+	{
+		int32_t result = 0;
+		std::thread thread([&]() { result = function.Call(10, 8); });
+		thread.join();
+		return result;
+	}
+
+	// More hooks than a process has TLS slots, which all share one slot for their disabled bits
+	void RunManyHooks(Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::EBX>, int32_t, int32_t, int32_t>& function)
+	{
+		std::vector<Hook<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::EBX>, int32_t, int32_t, int32_t>> hooks;
+		for (int i = 0; i < 1100; i++)
+			hooks.emplace_back(function, (uintptr_t)&Subtract_Hook, 5);
+
+		hooks.back().SetEnabledOnCurrentThread(false);
+		assert(!hooks.back().IsEnabledOnCurrentThread());
+		assert(hooks.front().IsEnabledOnCurrentThread());
+
+		hooks.back().Install();
+		assert(function.Call(10, 8) == 2);
+		assert(CallOnOtherThread(function) == -2);
+		hooks.back().Uninstall();
+
+		// Released ids are handed out again, without the bits previous owners left behind
+		hooks.clear();
+		Reclaimer::Collect();
+		Hook hook(function, (uintptr_t)&Subtract_Hook, 5);
+		assert(hook.IsEnabledOnCurrentThread());
+	}
+
+	void Run()
+	{
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::EBX>, int32_t, int32_t, int32_t> function((uintptr_t)&Subtract_ArgumentsRegistersOnly);
+		Hook hook(function, (uintptr_t)&Subtract_Hook, 5);
+		hook.Install();
+
+		assert(hook.IsEnabledOnCurrentThread());
+		assert(function.Call(10, 8) == -2);
+
+		hook.SetEnabledOnCurrentThread(false);
+		assert(!hook.IsEnabledOnCurrentThread());
+		assert(function.Call(10, 8) == 2);
+		assert(CallOnOtherThread(function) == -2);
+
+		hook.SetEnabledOnCurrentThread(true);
+		assert(function.Call(10, 8) == -2);
+
+		hook.Uninstall();
+
+		RunManyHooks(function);
+	}
+}
+
+namespace CallSiteTests
+{
+	using namespace Unconventional;
+
+	int32_t Triple_Hook(int32_t x)
+	{
+		return x * 10;
+	}
+
+	void Run()
+	{
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX>, int32_t, int32_t> triple((uintptr_t)&Triple);
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX>, int32_t, int32_t> callTriplePlusOne((uintptr_t)&CallTriplePlusOne);
+
+		// The byte scan can't tell the fake call from a real one, so only verified sites are handed to the hook
+		const auto fakeCallSite = (uintptr_t)&FakeCallToTriple + 2;
+		DWORD oldProtection;
+		VirtualProtect((void*)fakeCallSite, Utils::SIZE_OF_JUMP, PAGE_EXECUTE_READWRITE, &oldProtection);
+		*(int32_t*)(fakeCallSite + 1) = (int32_t)((uintptr_t)&Triple - fakeCallSite - Utils::SIZE_OF_JUMP);
+
+		const auto candidates = ModuleUtils::FindCallSites(GetModuleHandleA(nullptr), (uintptr_t)&Triple);
+		assert(std::find(candidates.begin(), candidates.end(), fakeCallSite) != candidates.end());
+		assert(std::find(candidates.begin(), candidates.end(), (uintptr_t)&CallTriplePlusOne) != candidates.end());
+
+		Hook hook(triple, (uintptr_t)&Triple_Hook, 5);
+
+		bool threw = false;
+		try
+		{
+			hook.InstallAtCallSites({ (uintptr_t)&Triple });
+		}
+		catch (const std::invalid_argument&)
+		{
+			threw = true;
+		}
+		assert(threw);
+
+		const int32_t fakeDisplacement = *(int32_t*)(fakeCallSite + 1);
+		assert(hook.InstallAtCallSites({ (uintptr_t)&CallTriplePlusOne }) == 1);
+		assert(*(int32_t*)(fakeCallSite + 1) == fakeDisplacement);
+
+		// Only the rewritten call is redirected, the function itself is untouched
+		assert(callTriplePlusOne.Call(2) == 21);
+		assert(triple.Call(2) == 6);
+		assert(hook.CallOriginalFunction(2) == 6);
+
+		// The prologue can't be patched on top of rewritten call sites
+		threw = false;
+		try
+		{
+			hook.Install();
+		}
+		catch (const std::logic_error&)
+		{
+			threw = true;
+		}
+		assert(threw);
+
+		hook.Uninstall();
+		assert(callTriplePlusOne.Call(2) == 7);
+	}
+}
+
+namespace DynamicHookTests
+{
+	using namespace Unconventional;
+
+	uint32_t __cdecl Subtract_Hook(uint32_t a, uint32_t b)
+	{
+		return b - a;
+	}
+
+	void Run()
+	{
+		const auto signature = RuntimeSignature::Parse("int __usercall Subtract@<eax>(int a@<eax>, int b@<ebx>)");
+
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::EBX>, int32_t, int32_t, int32_t> function((uintptr_t)&Subtract_ArgumentsRegistersOnly);
+		DynamicHook hook((uintptr_t)&Subtract_ArgumentsRegistersOnly, signature, (uintptr_t)&Subtract_Hook, 5);
+		hook.Install();
+
+		assert(function.Call(10, 8) == -2);
+		assert((int32_t)hook.CallOriginalFunction({ 10, 8 }) == 2);
+
+		hook.Uninstall();
+		assert(function.Call(10, 8) == 2);
+	}
+}
+
+namespace RetargetTests
+{
+	using namespace Unconventional;
+
+	int32_t Subtract_HookA(int32_t a, int32_t b)
+	{
+		return b - a;
+	}
+
+	int32_t Subtract_HookB(int32_t a, int32_t b)
+	{
+		return a - b + 1000;
+	}
+
+	void Run()
+	{
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> function((uintptr_t)&Subtract_ArgumentsStackOnly);
+		Hook hook(function, (uintptr_t)&Subtract_HookA, 8);
+		hook.Install();
+
+		std::atomic<bool> isRunning = true;
+		std::atomic<uint32_t> invalidResults = 0;
+		std::atomic<uint32_t> callsA = 0;
+		std::atomic<uint32_t> callsB = 0;
+
+		std::vector<std::thread> threads;
+		for (int i = 0; i < 4; i++)
+		{
+			threads.emplace_back([&]()
+			{
+				while (isRunning)
+				{
+					const auto result = function.Call(10, 8);
+					if (result == -2)
+						callsA++;
+					else if (result == 1002)
+						callsB++;
+					else
+						invalidResults++;
+				}
+			});
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		for (int i = 0; i < 100000; i++)
+		{
+			hook.Retarget((uintptr_t)((i % 2 == 0) ? &Subtract_HookB : &Subtract_HookA));
+		}
+		hook.Retarget((uintptr_t)&Subtract_HookB);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		isRunning = false;
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+
+		assert(invalidResults == 0);
+		assert(callsA > 0 && callsB > 0);
+		assert(function.Call(10, 8) == 1002);
+
+		hook.Uninstall();
+		assert(function.Call(10, 8) == 2);
+	}
+}
+
+namespace ReclamationTests
+{
+	using namespace Unconventional;
+
+	using SubtractSignature = FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::EBX>;
+
+	std::atomic<bool> isInsideHook = false;
+	std::atomic<bool> mayReturn = false;
+
+	int32_t Subtract_BlockingHook(int32_t a, int32_t b)
+	{
+		isInsideHook = true;
+		while (!mayReturn)
+			std::this_thread::yield();
+
+		return b - a;
+	}
+
+	int32_t Subtract_Hook(int32_t a, int32_t b)
+	{
+		return b - a;
+	}
+
+	int32_t Subtract_ThrowingHook(int32_t a, int32_t b)
+	{
+		throw std::runtime_error("Subtract_ThrowingHook");
+	}
+
+	// An exception leaving a hook skips the end of the wrapper, which must not leave the thread counted as inside it
+	void RunThrowingHook(Function<SubtractSignature, int32_t, int32_t, int32_t>& function)
+	{
+		Hook<SubtractSignature, int32_t, int32_t, int32_t> hook(function, (uintptr_t)&Subtract_ThrowingHook, 5);
+		hook.Install();
+
+		bool hasThrown = false;
+		try
+		{
+			function.Call(10, 8);
+		}
+		catch (const std::runtime_error&)
+		{
+			hasThrown = true;
+		}
+		assert(hasThrown);
+
+		hook = Hook<SubtractSignature, int32_t, int32_t, int32_t>();
+		assert(function.Call(10, 8) == 2);
+		assert(Reclaimer::Collect() == 0);
+	}
+
+	// Fresh threads register themselves on their first hook call, which retiring must not block
+	void RunRetireDuringRegistration(Function<SubtractSignature, int32_t, int32_t, int32_t>& function)
+	{
+		constexpr int ROUND_COUNT = 50;
+		constexpr int THREAD_COUNT = 4;
+
+		for (int round = 0; round < ROUND_COUNT; round++)
+		{
+			Hook<SubtractSignature, int32_t, int32_t, int32_t> hook(function, (uintptr_t)&Subtract_Hook, 5);
+			hook.Install();
+
+			int32_t results[THREAD_COUNT] = {};
+			std::vector<std::thread> threads;
+			for (int i = 0; i < THREAD_COUNT; i++)
+				threads.emplace_back([&, i]() { results[i] = function.Call(10, 8); });
+
+			hook = Hook<SubtractSignature, int32_t, int32_t, int32_t>();
+
+			for (auto& thread : threads)
+				thread.join();
+			for (const auto result : results)
+				assert(result == -2 || result == 2);
+		}
+
+		assert(Reclaimer::Collect() == 0);
+	}
+
+	void Run()
+	{
+		Function<SubtractSignature, int32_t, int32_t, int32_t> function((uintptr_t)&Subtract_ArgumentsRegistersOnly);
+		Hook<SubtractSignature, int32_t, int32_t, int32_t> hook(function, (uintptr_t)&Subtract_BlockingHook, 5);
+		hook.Install();
+
+		int32_t result = 0;
+		std::thread thread([&]() { result = function.Call(10, 8); });
+		while (!isInsideHook)
+			std::this_thread::yield();
+
+		// Destroying the hook uninstalls it at once, but its code and context stay around for the call in flight
+		hook = Hook<SubtractSignature, int32_t, int32_t, int32_t>();
+		assert(function.Call(10, 8) == 2);
+		assert(Reclaimer::Collect() == 1);
+
+		mayReturn = true;
+		thread.join();
+		assert(result == -2);
+		assert(Reclaimer::Collect() == 0);
+
+		RunRetireDuringRegistration(function);
+		RunThrowingHook(function);
+	}
+}
+
+namespace MemoizationTests
+{
+	using namespace Unconventional;
+
+	Hook<Pure<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX>>, int32_t, int32_t> hook;
+	int32_t Square_Hook(int32_t x)
+	{
+		return hook.CallOriginalFunction(x);
+	}
+
+	void Run()
+	{
+		Function<Pure<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX>>, int32_t, int32_t> function((uintptr_t)&Square_Counted);
+		hook = Hook(function, (uintptr_t)&Square_Hook, 5);
+		hook.Install();
+
+		squareCallCount = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			assert(function.Call(7) == 49);
+		}
+		assert(squareCallCount == 1);
+		assert(hook.GetMemoizationStatistics().hits == 2);
+		assert(hook.GetMemoizationStatistics().misses == 1);
+
+		assert(function.Call(8) == 64);
+		assert(squareCallCount == 2);
+
+		hook.InvalidateMemoizedResult(7);
+		assert(function.Call(7) == 49);
+		assert(function.Call(8) == 64);
+		assert(squareCallCount == 3);
+
+		hook.InvalidateMemoizedResults();
+		assert(function.Call(7) == 49);
+		assert(function.Call(8) == 64);
+		assert(squareCallCount == 5);
+
+		hook.Uninstall();
+
+		// An invalidation between the miss and Store must win over the value computed before it
+		MemoizationCache<1, 16> cache;
+		const auto ticket = cache.GetTicket({ 7 });
+		cache.Invalidate({ 7 });
+		cache.Store({ 7 }, 49, ticket);
+		uint32_t value;
+		assert(!cache.TryGet({ 7 }, value));
+	}
+}
+
+namespace ProbeTests
+{
+	using namespace Unconventional;
+
+	struct Counters
+	{
+		uint32_t enters;
+		uint32_t exits;
+		uint32_t unwound;
+		uint32_t maxDepth;
+	};
+
+	void OnEnter(const ProbeEvent& event, void* userData)
+	{
+		auto* counters = (Counters*)userData;
+		counters->enters++;
+		counters->maxDepth = event.depth > counters->maxDepth ? event.depth : counters->maxDepth;
+		assert(event.functionAddress == (uintptr_t)&Countdown);
+		assert(event.parentFunctionAddress == (event.depth > 0 ? (uintptr_t)&Countdown : 0));
+	}
+
+	void OnExit(const ProbeEvent& event, void* userData)
+	{
+		auto* counters = (Counters*)userData;
+		counters->exits++;
+		counters->unwound += event.isUnwound ? 1 : 0;
+	}
+
+	void CountEnter(const ProbeEvent& event, void* userData)
+	{
+		((Counters*)userData)->enters++;
+	}
+
+	void Throw()
+	{
+		throw std::runtime_error("Leaving the probed frame");
+	}
+
+	void Return()
+	{
+	}
+
+	// The exit stub is skipped when an exception leaves the frame, which is noticed on the next probe event at the same depth
+	void RunUnwound()
+	{
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack>, int32_t, uintptr_t> function((uintptr_t)&CallCallback);
+
+		Counters counters{};
+		Probe probe(function, 5, &CountEnter, &OnExit, &counters);
+		probe.Install();
+
+		bool threw = false;
+		try
+		{
+			function.Call((uintptr_t)&Throw);
+		}
+		catch (const std::runtime_error&)
+		{
+			threw = true;
+		}
+		assert(threw);
+		assert(counters.exits == 0);
+
+		function.Call((uintptr_t)&Return);
+		assert(counters.enters == 2);
+		assert(counters.exits == 2);
+		assert(counters.unwound == 1);
+	}
+
+	// TailCallTriple jumps into Triple, so both probed frames share one return slot
+	void RunTailCall()
+	{
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX>, int32_t, int32_t> tailCaller((uintptr_t)&TailCallTriple);
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX>, int32_t, int32_t> callee((uintptr_t)&Triple);
+
+		Counters counters{};
+		Probe tailCallerProbe(tailCaller, 5, &CountEnter, &OnExit, &counters);
+		Probe calleeProbe(callee, 5, &CountEnter, &OnExit, &counters);
+		tailCallerProbe.Install();
+		calleeProbe.Install();
+
+		assert(tailCaller.Call(4) == 15);
+		assert(tailCaller.Call(1) == 6);
+		assert(counters.enters == 4);
+		assert(counters.exits == 4);
+		assert(counters.unwound == 0);
+	}
+
+	void Run()
+	{
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX>, int32_t, int32_t> function((uintptr_t)&Countdown);
+
+		Counters counters{};
+		Probe probe(function, 5, &OnEnter, &OnExit, &counters);
+		probe.Install();
+
+		assert(function.Call(4) == 4);
+		assert(counters.enters == 5);
+		assert(counters.exits == 5);
+		assert(counters.unwound == 0);
+		assert(counters.maxDepth == 4);
+
+		probe.Uninstall();
+
+		assert(function.Call(4) == 4);
+		assert(counters.enters == 5);
+
+		RunUnwound();
+		RunTailCall();
+	}
+}
+
+namespace CaptureTests
+{
+	using namespace Unconventional;
+
+	Hook<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> hook;
+	int32_t Subtract_Hook(int32_t a, int32_t b)
+	{
+		return hook.CallOriginalFunction(a, b);
+	}
+
+	void Run()
+	{
+		char tempPath[MAX_PATH];
+		GetTempPathA(MAX_PATH, tempPath);
+		const std::string capturePath = std::string(tempPath) + "Unconventional_CaptureTests.bin";
+
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> function((uintptr_t)&Subtract_ArgumentsStackOnly);
+		hook = Hook(function, (uintptr_t)&Subtract_Hook, 8);
+		hook.Install();
+
+		assert(function.Call(1, 2) == -1);
+
+		hook.StartCapture(capturePath);
+		assert(function.Call(10, 8) == 2);
+		assert(function.Call(7, 3) == 4);
+		hook.StopCapture();
+
+		assert(function.Call(5, 5) == 0);
+		hook.Uninstall();
+
+		const Recording recording(capturePath);
+		assert(recording.GetArgumentCount() == 2);
+		assert(recording.GetCallCount() == 2);
+		assert(recording.GetArguments(0)[0] == 10 && recording.GetArguments(0)[1] == 8);
+		assert(recording.GetArguments(1)[0] == 7 && recording.GetArguments(1)[1] == 3);
+
+		assert(Replay(function, recording, 100, CacheState::Warm).callCount == 200);
+		assert(Replay(function, recording, 1, CacheState::Cold).callCount == 2);
+
+		DeleteFileA(capturePath.c_str());
+	}
+}
+
+namespace SymbolMapTests
+{
+	using namespace Unconventional;
+
+	int32_t Subtract_Hook(int32_t a, int32_t b)
+	{
+		return b - a;
+	}
+
+	std::string ReadFile(const std::string& path)
+	{
+		std::ifstream file(path);
+		std::stringstream contents;
+		contents << file.rdbuf();
+		return contents.str();
+	}
+
+	void Run()
+	{
+		char tempPath[MAX_PATH];
+		GetTempPathA(MAX_PATH, tempPath);
+		const std::string mapPath = std::string(tempPath) + "Unconventional_SymbolMapTests.map";
+
+		SymbolMap::Enable(mapPath);
+		assert(SymbolMap::IsEnabled());
+
+		const auto trampolineName = SymbolMap::MakeName("Trampoline", (uintptr_t)&Subtract_ArgumentsMixed);
+		{
+			Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::Stack>, int32_t, int32_t, int32_t> function((uintptr_t)&Subtract_ArgumentsMixed);
+			Hook hook(function, (uintptr_t)&Subtract_Hook, 5);
+
+			const auto contents = ReadFile(mapPath);
+			assert(contents.find(trampolineName) != std::string::npos);
+			assert(contents.find("Unconventional::HookEntry@") != std::string::npos);
+			assert(contents.find("Unconventional::HookWrapper(EAX, Stack) -> EAX") != std::string::npos);
+		}
+
+		// Destroyed blocks leave at most as many stale lines as there are live ones, and re-enabling drops them all
+		SymbolMap::Enable(mapPath);
+		assert(ReadFile(mapPath).find(trampolineName) == std::string::npos);
+
+		SymbolMap::Disable();
+		DeleteFileA(mapPath.c_str());
+	}
+}
+
+namespace CoverageTests
+{
+	using namespace Unconventional;
+
+	void Run()
+	{
+		char tempPath[MAX_PATH];
+		GetTempPathA(MAX_PATH, tempPath);
+		const std::string coveragePath = std::string(tempPath) + "Unconventional_CoverageTests.bin";
+
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> subtract((uintptr_t)&Subtract_ArgumentsStackOnly);
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> add((uintptr_t)&Add_ArgumentsStackOnly);
+		Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX>, int32_t, int32_t> triple((uintptr_t)&Triple);
+
+		const uint8_t originalByte = *(uint8_t*)&Subtract_ArgumentsStackOnly;
+
+		CoverageProbes probes({ (uintptr_t)&Subtract_ArgumentsStackOnly, (uintptr_t)&Add_ArgumentsStackOnly, (uintptr_t)&Triple });
+		probes.Install();
+		assert(*(uint8_t*)&Subtract_ArgumentsStackOnly == 0xE9);
+
+		// The first call goes through the probe, which takes itself out
+		assert(subtract.Call(5, 3) == 2);
+		assert(probes.WasHit(0) && !probes.WasHit(1) && !probes.WasHit(2));
+		assert(*(uint8_t*)&Subtract_ArgumentsStackOnly == originalByte);
+		assert(subtract.Call(5, 3) == 2);
+
+		// Several threads hitting the same probe at once all end up in the original function
+		std::atomic<bool> start = false;
+		std::atomic<int32_t> correctResults = 0;
+		std::vector<std::thread> threads;
+		for (int32_t i = 0; i < 4; i++)
+		{
+			threads.emplace_back([&, i]()
+			{
+				while (!start)
+					std::this_thread::yield();
+
+				if (add.Call(i, 10) == i + 10)
+					correctResults++;
+			});
+		}
+		start = true;
+		for (auto& thread : threads)
+			thread.join();
+
+		assert(correctResults == 4);
+		assert(probes.GetHitCount() == 2);
+
+		probes.Save(coveragePath);
+		assert((CoverageProbes::Load(coveragePath) == std::vector<bool>{ true, true, false }));
+
+		// A probe count the file can't hold is rejected before anything is allocated for it
+		{
+			CoverageHeader header{};
+			std::ifstream(coveragePath, std::ios::binary).read((char*)&header, sizeof(header));
+			header.probeCount = 0xFFFFFFFF;
+			std::ofstream(coveragePath, std::ios::binary | std::ios::trunc).write((const char*)&header, sizeof(header));
+
+			bool hasThrown = false;
+			try
+			{
+				CoverageProbes::Load(coveragePath);
+			}
+			catch (const std::runtime_error&)
+			{
+				hasThrown = true;
+			}
+			assert(hasThrown);
+		}
+
+		// Probes that never ran are removed on uninstall
+		probes.Uninstall();
+		assert(triple.Call(2) == 6);
+		assert(!probes.WasHit(2));
+
+		DeleteFileA(coveragePath.c_str());
+	}
+}
 
 void RunHookingTests()
 {
 	BasicRedirectionTests::Run();
 	TrampolineTests::Run();
+	MoveTests::Run();
+	SharedWrapperTests::Run();
+	BypassTests::Run();
+	CallSiteTests::Run();
+	DynamicHookTests::Run();
+	RetargetTests::Run();
+	ReclamationTests::Run();
+	MemoizationTests::Run();
+	ProbeTests::Run();
+	CaptureTests::Run();
+	SymbolMapTests::Run();
+	CoverageTests::Run();
 }
\ No newline at end of file
@@ -0,0 +1,247 @@
+#include "Test.hpp"
+#include "../Unconventional.hpp"
+
+namespace MemoryTests
+{
+	using namespace Unconventional;
+
+	struct Player
+	{
+		int32_t health;
+		float position[3];
+	};
+
+	struct World
+	{
+		uint32_t padding[4];
+		Player* localPlayer;
+	};
+
+	void RunPointerChainTests(ProcessMemory& memory)
+	{
+		Player player{ 100, { 1.0f, 2.0f, 3.0f } };
+		World world{ {}, &player };
+		World* worldPointer = &world;
+
+		// [[&worldPointer] + 0x10] + 4 -> player.position[0]
+		Pointer<float> positionX(memory, (uintptr_t)&worldPointer, { 0, offsetof(World, localPlayer), offsetof(Player, position) });
+		assert(positionX.Resolve() == (uintptr_t)&player.position[0]);
+		assert(positionX.Read() == 1.0f);
+
+		positionX.Write(5.0f);
+		assert(player.position[0] == 5.0f);
+
+		Pointer<int32_t> health(memory, (uintptr_t)&player, { offsetof(Player, health) });
+		assert(health.Read() == 100);
+	}
+
+	// Reads more than 4KB apart are not merged, and a merged read spanning an unreadable page falls back to one call per request
+	void RunScatteredBatchTests(ProcessMemory& memory)
+	{
+		constexpr size_t PAGE_BYTES = 4096;
+		auto* pages = (uint8_t*)VirtualAlloc(nullptr, 7 * PAGE_BYTES, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		assert(pages != nullptr);
+
+		int32_t* const addresses[] = {
+			(int32_t*)(pages + PAGE_BYTES - sizeof(int32_t)),
+			(int32_t*)(pages + 2 * PAGE_BYTES),
+			(int32_t*)(pages + 4 * PAGE_BYTES),
+			(int32_t*)(pages + 6 * PAGE_BYTES)
+		};
+		for (int i = 0; i < 4; i++)
+			*addresses[i] = i + 1;
+
+		DWORD oldProtection;
+		VirtualProtect(pages + PAGE_BYTES, PAGE_BYTES, PAGE_NOACCESS, &oldProtection);
+
+		int32_t values[4] = {};
+		ReadBatch batch(memory);
+		for (int i = 0; i < 4; i++)
+			batch.Add((uintptr_t)addresses[i], &values[i]);
+
+		const auto start = memory.GetSystemCallCount();
+		batch.Execute();
+
+		// The first two are merged across the unreadable page, failing once and then read one by one; the others are read alone
+		assert(memory.GetSystemCallCount() - start == 5);
+		for (int i = 0; i < 4; i++)
+			assert(values[i] == i + 1);
+
+		VirtualFree(pages, 0, MEM_RELEASE);
+	}
+
+	void Run()
+	{
+		ProcessMemory localMemory;
+		RunPointerChainTests(localMemory);
+
+		// Go through the kernel by opening our own process, just like with any other one
+		const HANDLE processHandle = OpenProcess(PROCESS_VM_READ | PROCESS_VM_WRITE | PROCESS_VM_OPERATION, FALSE, GetCurrentProcessId());
+		assert(processHandle != nullptr);
+
+		{
+			ProcessMemory remoteMemory(processHandle);
+			RunPointerChainTests(remoteMemory);
+
+			constexpr int VALUE_COUNT = 64;
+			int32_t values[VALUE_COUNT];
+			for (int i = 0; i < VALUE_COUNT; i++)
+			{
+				values[i] = i * 3;
+			}
+
+			int32_t individuallyRead[VALUE_COUNT];
+			const auto individualStart = remoteMemory.GetSystemCallCount();
+			for (int i = 0; i < VALUE_COUNT; i++)
+			{
+				individuallyRead[i] = remoteMemory.Read<int32_t>((uintptr_t)&values[i]);
+			}
+			const auto individualCalls = remoteMemory.GetSystemCallCount() - individualStart;
+
+			// Every other value, in reverse order, still ends up as one read
+			int32_t batchRead[VALUE_COUNT] = {};
+			ReadBatch batch(remoteMemory);
+			for (int i = VALUE_COUNT - 1; i >= 0; i -= 2)
+			{
+				batch.Add((uintptr_t)&values[i], &batchRead[i]);
+			}
+			const auto batchStart = remoteMemory.GetSystemCallCount();
+			batch.Execute();
+			const auto batchCalls = remoteMemory.GetSystemCallCount() - batchStart;
+
+			for (int i = 0; i < VALUE_COUNT; i++)
+			{
+				assert(individuallyRead[i] == values[i]);
+				assert(batchRead[i] == (i % 2 == 1 ? values[i] : 0));
+			}
+			assert(individualCalls == VALUE_COUNT);
+			assert(batchCalls == 1);
+
+			RunScatteredBatchTests(remoteMemory);
+		}
+
+		CloseHandle(processHandle);
+	}
+}
+
+namespace RemoteCallTests
+{
+	using namespace Unconventional;
+
+	void __declspec(naked) Multiply_ArgumentsMixed(/*int32_t<eax> a, int32_t b*/)
+	{
+		__asm
+		{
+			imul eax, [esp + 4]
+			ret
+		}
+	}
+
+	int32_t __cdecl Add(int32_t a, int32_t b)
+	{
+		return a + b;
+	}
+
+	// Starts a second instance of this executable, which only waits to be called into
+	PROCESS_INFORMATION StartTarget()
+	{
+		SECURITY_ATTRIBUTES attributes{ sizeof(attributes), nullptr, TRUE };
+		const HANDLE readyEvent = CreateEventA(&attributes, TRUE, FALSE, nullptr);
+		assert(readyEvent != nullptr);
+
+		char path[MAX_PATH];
+		GetModuleFileNameA(nullptr, path, MAX_PATH);
+		std::string commandLine = "\"" + std::string(path) + "\" --remote-target " + std::to_string((uintptr_t)readyEvent);
+
+		STARTUPINFOA startupInfo{};
+		startupInfo.cb = sizeof(startupInfo);
+		PROCESS_INFORMATION processInformation{};
+		const BOOL isCreated = CreateProcessA(nullptr, commandLine.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startupInfo, &processInformation);
+		assert(isCreated);
+
+		const DWORD waitResult = WaitForSingleObject(readyEvent, 10000);
+		assert(waitResult == WAIT_OBJECT_0);
+		CloseHandle(readyEvent);
+
+		return processInformation;
+	}
+
+	// The target may have loaded the executable at a different base, so functions are found by their RVA
+	uintptr_t GetImageBase(const DWORD processId)
+	{
+		const auto snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, processId);
+		assert(snapshot != INVALID_HANDLE_VALUE);
+
+		MODULEENTRY32 entry{};
+		entry.dwSize = sizeof(entry);
+		const BOOL isFound = Module32First(snapshot, &entry);
+		CloseHandle(snapshot);
+		assert(isFound);
+
+		return (uintptr_t)entry.modBaseAddr;
+	}
+
+	void Run()
+	{
+		const auto target = StartTarget();
+		const auto imageBase = GetImageBase(target.dwProcessId);
+		const auto toTarget = [&](const uintptr_t address) { return imageBase + (address - (uintptr_t)GetModuleHandleA(nullptr)); };
+
+		{
+			RemoteProcess process(target.hProcess);
+
+			Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::EAX, Location::Stack>, int32_t, int32_t, int32_t> multiply(toTarget((uintptr_t)&Multiply_ArgumentsMixed));
+			Function<FunctionSignature<CallingConvention::Cdecl, Location::EAX, Location::Stack, Location::Stack>, int32_t, int32_t, int32_t> add(toTarget((uintptr_t)&Add));
+
+			assert(multiply.CallRemote(process, 6, 7) == 42);
+			assert(add.CallRemote(process, 6, 7) == 13);
+			assert(process.GetRoundTripCount() == 2);
+
+			// Consecutive calls share one round trip
+			std::vector<RemoteResult<int32_t>> results;
+			for (int32_t i = 0; i < 100; i++)
+				results.push_back(i % 2 == 0 ? process.Enqueue(multiply, i, 3) : process.Enqueue(add, i, 3));
+
+			assert(!results[0].IsReady());
+			bool threw = false;
+			try
+			{
+				results[0].Get();
+			}
+			catch (const std::logic_error&)
+			{
+				threw = true;
+			}
+			assert(threw);
+
+			process.Flush();
+			assert(process.GetRoundTripCount() == 3);
+			for (int32_t i = 0; i < 100; i++)
+				assert(results[i].Get() == (i % 2 == 0 ? i * 3 : i + 3));
+		}
+
+		TerminateProcess(target.hProcess, 0);
+		WaitForSingleObject(target.hProcess, INFINITE);
+		CloseHandle(target.hThread);
+		CloseHandle(target.hProcess);
+	}
+
+	// Entry point of the target instance started by StartTarget
+	void RunTarget(const HANDLE readyEvent)
+	{
+		SetEvent(readyEvent);
+		CloseHandle(readyEvent);
+		Sleep(INFINITE);
+	}
+}
+
+void RunMemoryTests()
+{
+	MemoryTests::Run();
+	RemoteCallTests::Run();
+}
+
+void RunRemoteTarget(const char* readyEvent)
+{
+	RemoteCallTests::RunTarget((HANDLE)(uintptr_t)std::stoull(readyEvent));
+}
@@ -1,14 +1,28 @@
 #include "Test.hpp"
 
+#include <cstring>
+
 void RunFunctionCallingTests();
 void RunHookingTests();
+void RunAddressCacheTests();
+void RunMemoryTests();
+void RunRemoteTarget(const char* readyEvent);
 
 void RunBenchmark();
 
-int main()
+int main(int argc, char* argv[])
 {
+	// RemoteCallTests start a second instance of this executable to call functions in
+	if (argc == 3 && std::strcmp(argv[1], "--remote-target") == 0)
+	{
+		RunRemoteTarget(argv[2]);
+		return 0;
+	}
+
 	RunFunctionCallingTests();
 	RunHookingTests();
+	RunAddressCacheTests();
+	RunMemoryTests();
 
 	RunBenchmark();
 
@@ -5,8 +5,25 @@
 #include <cstdint>
 #include <array>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include <fstream>
+#include <atomic>
+#include <memory>
+#include <intrin.h>
+#include <mutex>
+#include <chrono>
+#include <utility>
+#include <variant>
+#include <cstddef>
+#include <cstdio>
+#include <unordered_set>
+#include <optional>
+#include <cctype>
 
 #include <Windows.h>
+#include <TlHelp32.h>
 
 namespace Unconventional
 {
@@ -39,6 +56,300 @@ namespace Unconventional
 		}
 	}
 
+	namespace LocationUtils
+	{
+		constexpr const char* GetName(const Location location)
+		{
+			switch (location)
+			{
+			case Location::Stack: return "Stack";
+			case Location::EAX: return "EAX";
+			case Location::EBX: return "EBX";
+			case Location::ECX: return "ECX";
+			case Location::EDX: return "EDX";
+			case Location::ESI: return "ESI";
+			case Location::EDI: return "EDI";
+			case Location::ST0: return "ST0";
+			default: return "?";
+			}
+		}
+
+		// The number x86 encodes the register with, e.g. in the low bits of push reg (0x50 + n)
+		constexpr uint8_t GetRegisterNumber(const Location location)
+		{
+			switch (location)
+			{
+			case Location::EAX: return 0;
+			case Location::ECX: return 1;
+			case Location::EDX: return 2;
+			case Location::EBX: return 3;
+			case Location::ESI: return 6;
+			case Location::EDI: return 7;
+			default:
+				throw std::exception("Not a general purpose register");
+			}
+		}
+
+		// "(EAX, Stack) -> EAX"
+		static std::string DescribeLayout(const std::vector<Location>& argumentLocations, const Location returnValueLocation)
+		{
+			std::string description = "(";
+			for (size_t i = 0; i < argumentLocations.size(); i++)
+			{
+				if (i > 0)
+					description += ", ";
+				description += GetName(argumentLocations[i]);
+			}
+			description += ") -> ";
+			description += GetName(returnValueLocation);
+			return description;
+		}
+	}
+
+	// Hands out executable memory in small blocks carved from shared chunks, rather than reserving
+	// a separate 64KB allocation for every trampoline and stub
+	class ExecutableMemory
+	{
+	public:
+		static uintptr_t Allocate(const size_t size)
+		{
+			const auto sizeClass = GetSizeClass(size);
+			if (sizeClass == SIZE_CLASS_COUNT)
+			{
+				return (uintptr_t)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+			}
+
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+
+			auto& freeList = state.freeLists[sizeClass];
+			if (!freeList.empty())
+			{
+				const auto address = freeList.back();
+				freeList.pop_back();
+				return address;
+			}
+
+			const auto blockSize = GetBlockSize(sizeClass);
+			if (state.chunkCursor + blockSize > state.chunkEnd)
+			{
+				state.chunkCursor = (uintptr_t)VirtualAlloc(nullptr, CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+				if (state.chunkCursor == 0)
+					throw std::runtime_error("Could not allocate executable memory");
+				state.chunkEnd = state.chunkCursor + CHUNK_SIZE;
+			}
+
+			const auto address = state.chunkCursor;
+			state.chunkCursor += blockSize;
+			return address;
+		}
+
+		static void Free(const uintptr_t address, const size_t size)
+		{
+			const auto sizeClass = GetSizeClass(size);
+			if (sizeClass == SIZE_CLASS_COUNT)
+			{
+				VirtualFree((void*)address, 0, MEM_RELEASE);
+				return;
+			}
+
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+			state.freeLists[sizeClass].push_back(address);
+		}
+
+	private:
+		static constexpr size_t CHUNK_SIZE = 64 * 1024;
+		static constexpr size_t SMALLEST_BLOCK_SIZE = 16;
+		static constexpr size_t SIZE_CLASS_COUNT = 6;
+
+		struct State
+		{
+			std::mutex mutex;
+			std::array<std::vector<uintptr_t>, SIZE_CLASS_COUNT> freeLists;
+			uintptr_t chunkCursor = 0;
+			uintptr_t chunkEnd = 0;
+		};
+
+		// Never destroyed, as hooks with static storage duration may free their code after it would have been
+		static State& GetState()
+		{
+			static State* state = new State();
+			return *state;
+		}
+
+		static constexpr size_t GetBlockSize(const size_t sizeClass)
+		{
+			return SMALLEST_BLOCK_SIZE << sizeClass;
+		}
+
+		// Returns SIZE_CLASS_COUNT for sizes that get their own allocation
+		static constexpr size_t GetSizeClass(const size_t size)
+		{
+			size_t sizeClass = 0;
+			while (sizeClass < SIZE_CLASS_COUNT && GetBlockSize(sizeClass) < size)
+			{
+				sizeClass++;
+			}
+			return sizeClass;
+		}
+	};
+
+	// Names generated code for profilers, in the perf map format: one "START SIZE name" line per block, hex without a prefix.
+	// Off until Enable is called. While enabled, creating or destroying a block appends or drops a single line.
+	class SymbolMap
+	{
+	public:
+		// The default path is %TEMP%\perf-<pid>.map
+		static void Enable(const std::string& path = "")
+		{
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+
+			state.path = path.empty() ? GetDefaultPath() : path;
+			if (!TryRewrite(state))
+				throw std::runtime_error("Could not open symbol map " + state.path);
+			isEnabled.store(true, std::memory_order_relaxed);
+		}
+
+		static void Disable()
+		{
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+
+			isEnabled.store(false, std::memory_order_relaxed);
+			state.file.close();
+		}
+
+		static bool IsEnabled()
+		{
+			return isEnabled.load(std::memory_order_relaxed);
+		}
+
+		static std::string GetPath()
+		{
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+			return state.path;
+		}
+
+		// Blocks are tracked even while disabled, so enabling later still names code that already exists.
+		// Never throws on I/O errors, as it runs whenever code is generated; the map is disabled instead.
+		static void Register(const uintptr_t address, const size_t size, const std::string& name)
+		{
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+
+			state.entries[address] = { size, name };
+
+			// A reused address must not be named twice in the file
+			if (state.staleAddresses.count(address) != 0)
+			{
+				if (IsEnabled() && !TryRewrite(state))
+					DisableAfterFailure(state);
+			}
+			else if (IsEnabled())
+			{
+				AppendLine(state.file, address, size, name);
+				state.file.flush();
+				if (!state.file)
+					DisableAfterFailure(state);
+			}
+		}
+
+		// Runs from destructors, so I/O errors disable the map instead of throwing
+		static void Unregister(const uintptr_t address)
+		{
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+
+			if (state.entries.erase(address) == 0 || !IsEnabled())
+				return;
+
+			// The format can't remove lines, so stale ones pile up until they outnumber the live ones
+			state.staleAddresses.insert(address);
+			if (state.staleAddresses.size() > state.entries.size() && !TryRewrite(state))
+				DisableAfterFailure(state);
+		}
+
+		// "Unconventional::Trampoline@401000"
+		static std::string MakeName(const char* kind, const uintptr_t functionAddress, const std::string& suffix = "")
+		{
+			char address[2 * sizeof(uintptr_t) + 1];
+			snprintf(address, sizeof(address), "%X", (uint32_t)functionAddress);
+			return std::string("Unconventional::") + kind + "@" + address + suffix;
+		}
+
+	private:
+		struct Entry
+		{
+			size_t size;
+			std::string name;
+		};
+
+		struct State
+		{
+			std::mutex mutex;
+			std::string path;
+			std::ofstream file;
+			std::unordered_map<uintptr_t, Entry> entries;
+
+			// Addresses that still have a line in the file although their block is gone
+			std::unordered_set<uintptr_t> staleAddresses;
+		};
+
+		static inline std::atomic<bool> isEnabled{ false };
+
+		// Never destroyed, for the same reason as ExecutableMemory's state
+		static State& GetState()
+		{
+			static State* state = new State();
+			return *state;
+		}
+
+		static std::string GetDefaultPath()
+		{
+			char temporaryDirectory[MAX_PATH + 1];
+			const auto length = GetTempPathA(sizeof(temporaryDirectory), temporaryDirectory);
+			if (length == 0 || length > MAX_PATH)
+				throw std::runtime_error("Could not get the temporary directory");
+
+			return std::string(temporaryDirectory, length) + "perf-" + std::to_string(GetCurrentProcessId()) + ".map";
+		}
+
+		static void AppendLine(std::ofstream& file, const uintptr_t address, const size_t size, const std::string& name)
+		{
+			file << std::hex << std::uppercase << address << ' ' << size << ' ' << name << '\n';
+		}
+
+		// Fails e.g. when a profiler holds the file without sharing it for writing
+		static bool TryRewrite(State& state)
+		{
+			state.file.close();
+			state.file.clear();
+			state.file.open(state.path, std::ios::out | std::ios::trunc);
+			if (!state.file)
+				return false;
+
+			for (const auto& [address, entry] : state.entries)
+				AppendLine(state.file, address, entry.size, entry.name);
+
+			state.file.flush();
+			state.staleAddresses.clear();
+			return (bool)state.file;
+		}
+
+		// A half written map would name the wrong code, so nothing more is written until Enable is called again
+		static void DisableAfterFailure(State& state)
+		{
+			isEnabled.store(false, std::memory_order_relaxed);
+			state.file.close();
+			state.file.clear();
+			state.entries.clear();
+			state.staleAddresses.clear();
+		}
+	};
+
 	namespace Utils
 	{
 		static uint8_t GetLowByte(uint32_t x)
@@ -50,6 +361,178 @@ namespace Unconventional
 		{
 			return (x >> 8) & 0xFF;
 		}
+
+		constexpr uint8_t SIZE_OF_JUMP = 5;
+
+		static void AppendUInt32(std::vector<uint8_t>& bytes, uint32_t x)
+		{
+			bytes.push_back(GetLowByte(x));
+			bytes.push_back(GetHighByte(x));
+			bytes.push_back(GetLowByte(x >> 16));
+			bytes.push_back(GetHighByte(x >> 16));
+		}
+
+		// Appends a rel32 jmp (0xE9) or call (0xE8), given the address the bytes will end up at
+		static void AppendRelative(std::vector<uint8_t>& bytes, uint8_t opCode, uintptr_t codeAddress, uintptr_t target)
+		{
+			bytes.push_back(opCode);
+			AppendUInt32(bytes, target - (codeAddress + bytes.size() + 4));
+		}
+
+		// mov eax, <the calling thread's value of a TLS slot>, read from the TEB directly: TlsSlots at fs:[0xE10]
+		// and TlsExpansionSlots at fs:[0xF94]. Leaves 0 in eax for slots the thread never set.
+		static void AppendLoadTlsSlot(std::vector<uint8_t>& bytes, const DWORD tlsIndex)
+		{
+			constexpr DWORD TEB_TLS_SLOT_COUNT = 64;
+			constexpr uint32_t TEB_TLS_SLOTS_OFFSET = 0xE10;
+			constexpr uint32_t TEB_TLS_EXPANSION_SLOTS_OFFSET = 0xF94;
+
+			if (tlsIndex < TEB_TLS_SLOT_COUNT)
+			{
+				// mov eax, fs:[TlsSlots + 4 * index]
+				bytes.insert(bytes.end(), { 0x64, 0xA1 });
+				AppendUInt32(bytes, TEB_TLS_SLOTS_OFFSET + 4 * tlsIndex);
+			}
+			else
+			{
+				// mov eax, fs:[TlsExpansionSlots]; test eax, eax; jz L1
+				bytes.insert(bytes.end(), { 0x64, 0xA1 });
+				AppendUInt32(bytes, TEB_TLS_EXPANSION_SLOTS_OFFSET);
+				bytes.insert(bytes.end(), { 0x85, 0xC0, 0x74, 0x06 });
+
+				// mov eax, [eax + 4 * (index - 64)]
+				bytes.insert(bytes.end(), { 0x8B, 0x80 });
+				AppendUInt32(bytes, 4 * (tlsIndex - TEB_TLS_SLOT_COUNT));
+
+				// L1:
+			}
+		}
+
+		static void WriteJump(const std::uintptr_t address, const std::uintptr_t target)
+		{
+			DWORD oldProtection;
+			VirtualProtect((void*)address, SIZE_OF_JUMP, PAGE_EXECUTE_READWRITE, &oldProtection);
+
+			const auto relativeJumpOffset = target - address - SIZE_OF_JUMP;
+
+			*(uint8_t*)address = 0xE9;
+			*(uint32_t*)(address + 1) = relativeJumpOffset;
+		}
+
+		// Replaces the five bytes at address while other threads may be executing them. If they lie in one aligned qword,
+		// the qword is swapped at once. Otherwise threads are parked on a jmp to itself while the tail is written.
+		static void WritePatch(const uintptr_t address, const uint8_t* bytes)
+		{
+			DWORD oldProtection;
+			VirtualProtect((void*)address, SIZE_OF_JUMP, PAGE_EXECUTE_READWRITE, &oldProtection);
+
+			const auto qwordAddress = address & ~(uintptr_t)7;
+			if (address + SIZE_OF_JUMP <= qwordAddress + 8)
+			{
+				auto* qword = (volatile LONG64*)qwordAddress;
+				LONG64 expected = *qword;
+				while (true)
+				{
+					LONG64 desired = expected;
+					std::memcpy((uint8_t*)&desired + (address - qwordAddress), bytes, SIZE_OF_JUMP);
+
+					const auto previous = InterlockedCompareExchange64(qword, desired, expected);
+					if (previous == expected)
+						break;
+
+					expected = previous;
+				}
+			}
+			else
+			{
+				// jmp $
+				InterlockedExchange16((volatile SHORT*)address, (SHORT)0xFEEB);
+				std::memcpy((void*)(address + 2), bytes + 2, SIZE_OF_JUMP - 2);
+				InterlockedExchange16((volatile SHORT*)address, *(const SHORT*)bytes);
+			}
+
+			FlushInstructionCache(GetCurrentProcess(), (void*)address, SIZE_OF_JUMP);
+		}
+
+		// Copies the first opCodeSize bytes of a function and jumps back to the rest of it
+		static uintptr_t CreateTrampoline(const uintptr_t functionAddress, const uint8_t opCodeSize)
+		{
+			const auto trampolineAddress = ExecutableMemory::Allocate(opCodeSize + SIZE_OF_JUMP);
+			std::memcpy((void*)trampolineAddress, (void*)functionAddress, opCodeSize);
+
+			WriteJump(trampolineAddress + opCodeSize, functionAddress + opCodeSize);
+
+			SymbolMap::Register(trampolineAddress, opCodeSize + SIZE_OF_JUMP, SymbolMap::MakeName("Trampoline", functionAddress));
+			return trampolineAddress;
+		}
+
+		// FNV-1a
+		static uint64_t Hash(const void* data, size_t size, uint64_t hash = 0xCBF29CE484222325)
+		{
+			for (size_t i = 0; i < size; i++)
+			{
+				hash ^= ((const uint8_t*)data)[i];
+				hash *= 0x100000001B3;
+			}
+			return hash;
+		}
+	}
+
+	namespace ModuleUtils
+	{
+		static const IMAGE_NT_HEADERS* GetNtHeaders(HMODULE module)
+		{
+			const auto* dosHeader = (const IMAGE_DOS_HEADER*)module;
+			if (dosHeader == nullptr || dosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+				throw std::invalid_argument("Module is not a valid PE image");
+
+			return (const IMAGE_NT_HEADERS*)((uintptr_t)module + dosHeader->e_lfanew);
+		}
+
+		struct Section
+		{
+			uintptr_t address;
+			size_t size;
+		};
+
+		static std::vector<Section> GetExecutableSections(HMODULE module)
+		{
+			std::vector<Section> sections;
+
+			const auto* ntHeaders = GetNtHeaders(module);
+			const auto* section = IMAGE_FIRST_SECTION(ntHeaders);
+			for (WORD i = 0; i < ntHeaders->FileHeader.NumberOfSections; i++, section++)
+			{
+				if ((section->Characteristics & IMAGE_SCN_MEM_EXECUTE) != 0)
+					sections.push_back({ (uintptr_t)module + section->VirtualAddress, section->Misc.VirtualSize });
+			}
+			return sections;
+		}
+
+		// Finds every E8 byte in the module's code whose rel32 points at target. This is a byte scan, not a disassembly:
+		// an immediate, a jump table or other data in an executable section can match too, so the results are only
+		// candidates. Verify them, e.g. with a disassembler, before writing to any of them.
+		static std::vector<uintptr_t> FindCallSites(HMODULE module, const uintptr_t target)
+		{
+			std::vector<uintptr_t> callSites;
+			for (const auto& section : GetExecutableSections(module))
+			{
+				if (section.size < Utils::SIZE_OF_JUMP)
+					continue;
+
+				const auto* current = (const uint8_t*)section.address;
+				const auto* end = (const uint8_t*)section.address + section.size - Utils::SIZE_OF_JUMP + 1;
+				while ((current = (const uint8_t*)std::memchr(current, 0xE8, end - current)) != nullptr)
+				{
+					const auto callSite = (uintptr_t)current;
+					if (callSite + Utils::SIZE_OF_JUMP + *(const int32_t*)(callSite + 1) == target)
+						callSites.push_back(callSite);
+
+					current++;
+				}
+			}
+			return callSites;
+		}
 	}
 
 	// TODO: Make these optional
@@ -129,74 +612,260 @@ namespace Unconventional
 
 			return GetArgumentIndexForRegister(location) != -1;
 		}
+
+		static consteval bool IsPure()
+		{
+			return false;
+		}
+
+		static consteval uint32_t GetMemoizationCacheSize()
+		{
+			return 0;
+		}
 		
 	};
 
-	template<typename Signature, typename ReturnType, typename... ArgumentTypes>
-	class Function
+	// Marks a signature as belonging to a pure function, which makes Hook memoize CallOriginalFunction
+	template<typename Signature, uint32_t memoizationCacheSize = 1024>
+	class Pure : public Signature
 	{
 	public:
 
-		Function(uintptr_t address) : address(address)
+		static consteval bool IsPure()
 		{
-			static_assert(sizeof(uint32_t) == 4);
-			static_assert(sizeof(uint16_t) == 2);
-			static_assert(sizeof(uint8_t) == 1);
+			return true;
 		}
 
-		uintptr_t GetAddress() const { return address; }
-
-		ReturnType Call(ArgumentTypes... arguments)
+		static consteval uint32_t GetMemoizationCacheSize()
 		{
-			constexpr uint32_t argumentCount = sizeof...(arguments);
-			static_assert(Signature::GetArgumentLocations().size() == argumentCount, "Amount of argument locations does not match number of function arguments");
-			
-			uint32_t integerArguments[argumentCount] { *(std::uint32_t*)&arguments... };
+			static_assert(memoizationCacheSize > 0 && (memoizationCacheSize & (memoizationCacheSize - 1)) == 0, "Memoization cache size has to be a power of two");
 
-			uintptr_t functionAddress = address;
+			return memoizationCacheSize;
+		}
+	};
 
-			// TODO: Prepare FPU Stack Arguments if needed. For now, floating point arguments are passed on the (regular) stack.
+	struct MemoizationStatistics
+	{
+		uint32_t hits;
+		uint32_t misses;
+		uint32_t evictions;
+	};
 
-			// Prepare Stack Arguments
-			
-			constexpr uint32_t stackArgumentCount = Signature::GetStackArgumentCount();
-			constexpr std::array<int32_t, stackArgumentCount> stackArgumentIndices = Signature::GetStackArgumentIndices();
-			constexpr auto byteSizeOfStackArguments = stackArgumentCount * 4;
-			
-			__asm pushad
+	// Fixed-size, direct-mapped, lock-free result cache. Every slot is guarded by a sequence lock:
+	// readers never block and writers simply skip a slot that is currently being written by someone else.
+	template<uint32_t keySize, uint32_t slotCount>
+	class MemoizationCache
+	{
+	public:
+		using Key = std::array<uint32_t, keySize>;
 
-			// TODO: Turn this into assembly
-			for (uint32_t i = stackArgumentCount; i > 0; --i)
-			{
-				uint32_t stackArgument = integerArguments[stackArgumentIndices[i - 1]];
-				__asm
-				{
-					push stackArgument
-				}
-			}
+		// Captured before computing a value; Store drops the value if InvalidateAll or Invalidate ran in between
+		struct Ticket
+		{
+			uint32_t generation;
+			uint32_t invalidations;
+		};
 
-			// Prepare Register Values
+		MemoizationCache() : generation(1), hits(0), misses(0), evictions(0)
+		{
+		}
 
-			static_assert(!Signature::HasArgumentInRegister(Location::ST0), "Arguments in FPU registers are currently not supported");
+		bool TryGet(const Key& key, uint32_t& value)
+		{
+			auto& slot = GetSlot(key);
+			const auto currentGeneration = generation.load(std::memory_order_relaxed);
 
-			if constexpr (Signature::HasArgumentInRegister(Location::EAX))
+			const auto sequence = slot.sequence.load(std::memory_order_acquire);
+			if ((sequence & 1) == 0)
 			{
-				constexpr auto argumentOffset = Signature::GetArgumentIndexForRegister(Location::EAX) * sizeof(uint32_t);
-				__asm
+				const bool isValid = slot.generation.load(std::memory_order_relaxed) == currentGeneration && SlotKeyEquals(slot, key);
+				const auto storedValue = slot.value.load(std::memory_order_relaxed);
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (isValid && slot.sequence.load(std::memory_order_relaxed) == sequence)
 				{
-					lea eax, integerArguments
-					add eax, argumentOffset
-					mov eax, [eax]
+					value = storedValue;
+					hits.fetch_add(1, std::memory_order_relaxed);
+					return true;
 				}
 			}
 
-			if constexpr (Signature::HasArgumentInRegister(Location::EBX))
-			{
-				constexpr auto argumentOffset = Signature::GetArgumentIndexForRegister(Location::EBX) * sizeof(uint32_t);
-				__asm
-				{
-					lea ebx, integerArguments
-					add ebx, argumentOffset
+			misses.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		// The ticket has to be taken before computing the value, so results racing with an invalidation are never stored as valid
+		Ticket GetTicket(const Key& key)
+		{
+			auto& slot = GetSlot(key);
+			const auto invalidations = slot.invalidations.load(std::memory_order_acquire);
+			return { generation.load(std::memory_order_relaxed), invalidations };
+		}
+
+		void Store(const Key& key, const uint32_t value, const Ticket& ticket)
+		{
+			auto& slot = GetSlot(key);
+
+			auto sequence = slot.sequence.load(std::memory_order_relaxed);
+			if ((sequence & 1) != 0 || !slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+				return;
+			std::atomic_thread_fence(std::memory_order_release);
+
+			// Invalidate bumps the counter while holding the slot, so checking it here can't miss one
+			if (slot.invalidations.load(std::memory_order_relaxed) != ticket.invalidations)
+			{
+				slot.sequence.store(sequence + 2, std::memory_order_release);
+				return;
+			}
+
+			if (slot.generation.load(std::memory_order_relaxed) == generation.load(std::memory_order_relaxed) && !SlotKeyEquals(slot, key))
+				evictions.fetch_add(1, std::memory_order_relaxed);
+
+			for (uint32_t i = 0; i < keySize; i++)
+			{
+				slot.key[i].store(key[i], std::memory_order_relaxed);
+			}
+			slot.value.store(value, std::memory_order_relaxed);
+			slot.generation.store(ticket.generation, std::memory_order_relaxed);
+
+			slot.sequence.store(sequence + 2, std::memory_order_release);
+		}
+
+		void Invalidate(const Key& key)
+		{
+			auto& slot = GetSlot(key);
+
+			auto sequence = slot.sequence.load(std::memory_order_relaxed);
+			while ((sequence & 1) != 0 || !slot.sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_relaxed))
+			{
+				sequence = slot.sequence.load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_release);
+
+			if (SlotKeyEquals(slot, key))
+				slot.generation.store(0, std::memory_order_relaxed);
+			slot.invalidations.fetch_add(1, std::memory_order_relaxed);
+
+			slot.sequence.store(sequence + 2, std::memory_order_release);
+		}
+
+		void InvalidateAll()
+		{
+			generation.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		MemoizationStatistics GetStatistics() const
+		{
+			return { hits.load(std::memory_order_relaxed), misses.load(std::memory_order_relaxed), evictions.load(std::memory_order_relaxed) };
+		}
+
+	private:
+		struct Slot
+		{
+			std::atomic<uint32_t> sequence;
+			std::atomic<uint32_t> generation;
+			std::atomic<uint32_t> invalidations;
+			std::atomic<uint32_t> value;
+			std::array<std::atomic<uint32_t>, keySize> key;
+		};
+
+		// Slots start out with generation 0, which never matches the cache generation
+		std::array<Slot, slotCount> slots{};
+		std::atomic<uint32_t> generation;
+
+		std::atomic<uint32_t> hits;
+		std::atomic<uint32_t> misses;
+		std::atomic<uint32_t> evictions;
+
+		Slot& GetSlot(const Key& key)
+		{
+			uint32_t hash = 0x9E3779B9;
+			for (const uint32_t word : key)
+			{
+				hash = (hash ^ word) * 0x85EBCA6B;
+				hash ^= hash >> 13;
+			}
+			return slots[hash & (slotCount - 1)];
+		}
+
+		static bool SlotKeyEquals(const Slot& slot, const Key& key)
+		{
+			for (uint32_t i = 0; i < keySize; i++)
+			{
+				if (slot.key[i].load(std::memory_order_relaxed) != key[i])
+					return false;
+			}
+			return true;
+		}
+	};
+
+	class RemoteProcess;
+
+	template<typename Signature, typename ReturnType, typename... ArgumentTypes>
+	class Function
+	{
+	public:
+
+		Function(uintptr_t address) : address(address)
+		{
+			static_assert(sizeof(uint32_t) == 4);
+			static_assert(sizeof(uint16_t) == 2);
+			static_assert(sizeof(uint8_t) == 1);
+		}
+
+		uintptr_t GetAddress() const { return address; }
+
+		ReturnType Call(ArgumentTypes... arguments)
+		{
+			constexpr uint32_t argumentCount = sizeof...(arguments);
+			static_assert(Signature::GetArgumentLocations().size() == argumentCount, "Amount of argument locations does not match number of function arguments");
+			
+			uint32_t integerArguments[argumentCount] { *(std::uint32_t*)&arguments... };
+
+			uintptr_t functionAddress = address;
+
+			// TODO: Prepare FPU Stack Arguments if needed. For now, floating point arguments are passed on the (regular) stack.
+
+			// Prepare Stack Arguments
+			
+			constexpr uint32_t stackArgumentCount = Signature::GetStackArgumentCount();
+			constexpr std::array<int32_t, stackArgumentCount> stackArgumentIndices = Signature::GetStackArgumentIndices();
+			constexpr auto byteSizeOfStackArguments = stackArgumentCount * 4;
+			
+			__asm pushad
+
+			// TODO: Turn this into assembly
+			for (uint32_t i = stackArgumentCount; i > 0; --i)
+			{
+				uint32_t stackArgument = integerArguments[stackArgumentIndices[i - 1]];
+				__asm
+				{
+					push stackArgument
+				}
+			}
+
+			// Prepare Register Values
+
+			static_assert(!Signature::HasArgumentInRegister(Location::ST0), "Arguments in FPU registers are currently not supported");
+
+			if constexpr (Signature::HasArgumentInRegister(Location::EAX))
+			{
+				constexpr auto argumentOffset = Signature::GetArgumentIndexForRegister(Location::EAX) * sizeof(uint32_t);
+				__asm
+				{
+					lea eax, integerArguments
+					add eax, argumentOffset
+					mov eax, [eax]
+				}
+			}
+
+			if constexpr (Signature::HasArgumentInRegister(Location::EBX))
+			{
+				constexpr auto argumentOffset = Signature::GetArgumentIndexForRegister(Location::EBX) * sizeof(uint32_t);
+				__asm
+				{
+					lea ebx, integerArguments
+					add ebx, argumentOffset
 					mov ebx, [ebx]
 				}
 			}
@@ -271,305 +940,3358 @@ namespace Unconventional
 			return *(ReturnType*)&returnValue;
 		}
 
+		// Calls the function at the same address in another process, on that process' helper thread. See RemoteProcess.
+		ReturnType CallRemote(RemoteProcess& process, ArgumentTypes... arguments);
+
 	private:
 		uintptr_t address;
 	};
 
 	
-	template<typename Signature, typename ReturnType, typename... ArgumentTypes>
-	class Hook
+	// A function signature only known at runtime, e.g. read from a config file. Parses prototypes in the notation IDA uses:
+	// "int __usercall f@<eax>(int a@<eax>, int b)". Arguments without a register are passed on the stack, in order.
+	class RuntimeSignature
 	{
 	public:
-		void Install()
+		RuntimeSignature(std::vector<Location> argumentLocations, const Location returnValueLocation, const bool returnsFloat = false)
+			: callingConvention(CallingConvention::Cdecl), argumentLocations(std::move(argumentLocations)), returnValueLocation(returnValueLocation), returnsFloat(returnsFloat)
 		{
-			if (!isInitialized)
-			{
-				throw std::logic_error("Hook was not initialized");
-			}
+			if (std::count(this->argumentLocations.begin(), this->argumentLocations.end(), Location::ST0) != 0)
+				throw std::invalid_argument("Arguments in FPU registers are currently not supported");
 
-			if (!isInstalled) 
-			{
-				WriteJump(originalFunction.GetAddress(), hookWrapperAddress);
-				isInstalled = true;
-			}
+			if (returnValueLocation == Location::Stack)
+				throw std::invalid_argument("Return value location can not be stack");
+
+			if (returnsFloat != (returnValueLocation == Location::ST0))
+				throw std::invalid_argument("Floating-point return values have to be in ST0");
 		}
 
-		void Uninstall()
+		static RuntimeSignature Parse(const std::string& prototype)
 		{
-			if (!isInitialized)
-			{
-				throw std::logic_error("Hook was not initialized");
-			}
+			const auto argumentsStart = prototype.find('(');
+			const auto argumentsEnd = prototype.rfind(')');
+			if (argumentsStart == std::string::npos || argumentsEnd == std::string::npos || argumentsEnd < argumentsStart)
+				throw std::invalid_argument("Prototype has no argument list: " + prototype);
+
+			// Return type, calling convention and name
+			std::string head = prototype.substr(0, argumentsStart);
+			const auto returnValueRegister = ExtractRegister(head);
+			auto headWords = SplitWords(head);
+			if (headWords.size() < 2)
+				throw std::invalid_argument("Prototype needs a return type and a name: " + prototype);
 
-			if (isInstalled) 
+			headWords.pop_back();
+			headWords.erase(std::remove_if(headWords.begin(), headWords.end(), IsCallingConvention), headWords.end());
+
+			const auto returnType = ClassifyType(headWords);
+			Location returnValueLocation = returnType == TypeClass::Float ? Location::ST0 : Location::EAX;
+			if (returnValueRegister.has_value())
+				returnValueLocation = *returnValueRegister;
+
+			// Arguments
+			std::vector<Location> argumentLocations;
+			const std::string arguments = prototype.substr(argumentsStart + 1, argumentsEnd - argumentsStart - 1);
+			if (arguments.find('(') != std::string::npos)
+				throw std::invalid_argument("Function pointer arguments are not supported, use void*: " + prototype);
+
+			size_t argumentStart = 0;
+			while (argumentStart <= arguments.size())
 			{
-				std::memcpy((void*)originalFunction.GetAddress(), (void*)trampolineAddress, opCodeSize);
-				isInstalled = false;
+				auto argumentEnd = arguments.find(',', argumentStart);
+				if (argumentEnd == std::string::npos)
+					argumentEnd = arguments.size();
+
+				std::string argument = arguments.substr(argumentStart, argumentEnd - argumentStart);
+				argumentStart = argumentEnd + 1;
+
+				const auto argumentRegister = ExtractRegister(argument);
+				const auto words = SplitWords(argument);
+				if (words.empty() || (words.size() == 1 && words[0] == "void"))
+				{
+					if (argumentEnd == arguments.size() && argumentLocations.empty())
+						break;
+
+					throw std::invalid_argument("Empty argument in prototype: " + prototype);
+				}
+
+				if (words[0] == "...")
+					throw std::invalid_argument("Variadic functions are not supported: " + prototype);
+
+				ClassifyType(words);
+				argumentLocations.push_back(argumentRegister.value_or(Location::Stack));
 			}
+
+			return RuntimeSignature(std::move(argumentLocations), returnValueLocation, returnValueLocation == Location::ST0);
 		}
 
-		ReturnType CallOriginalFunction(ArgumentTypes... arguments)
+		CallingConvention GetCallingConvention() const { return callingConvention; }
+		const std::vector<Location>& GetArgumentLocations() const { return argumentLocations; }
+		Location GetReturnValueLocation() const { return returnValueLocation; }
+		bool ReturnsFloat() const { return returnsFloat; }
+
+		uint32_t GetStackArgumentCount() const
 		{
-			Function<Signature, ReturnType, ArgumentTypes...> trampolineFunction(trampolineAddress);
-			return trampolineFunction.Call(arguments...);
+			return (uint32_t)std::count(argumentLocations.begin(), argumentLocations.end(), Location::Stack);
 		}
 
-		Hook() : isInitialized(false), isInstalled(false), opCodeSize(0), originalFunction(0), userHookFunctionAddress(0),
-		         trampolineAddress(0),
-		         hookWrapperAddress(0),
-		         tempStorage{}
+		std::string Describe() const
 		{
+			return LocationUtils::DescribeLayout(argumentLocations, returnValueLocation);
 		}
 
-		Hook(Function<Signature, ReturnType, ArgumentTypes...> originalFunction, uintptr_t hookFunctionAddress, const uint8_t opCodeSize)
-			: isInstalled(false), opCodeSize(opCodeSize), originalFunction(originalFunction), userHookFunctionAddress(hookFunctionAddress), trampolineAddress(0), hookWrapperAddress(0)
+	private:
+		CallingConvention callingConvention;
+		std::vector<Location> argumentLocations;
+		Location returnValueLocation;
+		bool returnsFloat;
+
+		enum class TypeClass
+		{
+			Integer,
+			Float
+		};
+
+		static std::string ToLower(std::string text)
 		{
-			if (opCodeSize < 5)
+			for (auto& character : text)
 			{
-				throw std::invalid_argument("At least 5 bytes are required for hooking");
+				if (character >= 'A' && character <= 'Z')
+					character = character - 'A' + 'a';
 			}
-
-			SetupTrampoline();
-			SetupHookWrapper();
-
-			isInitialized = true;
+			return text;
 		}
 
-		~Hook()
+		// Splits on whitespace, keeping '*' and '&' as words of their own
+		static std::vector<std::string> SplitWords(const std::string& text)
 		{
-			if (isInitialized) 
+			std::vector<std::string> words;
+			std::string word;
+			for (const char character : text)
 			{
-				Uninstall();
+				if (character == ' ' || character == '\t' || character == '*' || character == '&' || character == ';')
+				{
+					if (!word.empty())
+						words.push_back(word);
+					word.clear();
 
-				VirtualFree((void*)trampolineAddress, trampolineSize, MEM_RELEASE);
-				VirtualFree((void*)hookWrapperAddress, MAX_HOOK_WRAPPER_CODE_SIZE, MEM_RELEASE);
+					if (character == '*' || character == '&')
+						words.push_back(std::string(1, character));
+				}
+				else
+				{
+					word.push_back(character);
+				}
 			}
+			if (!word.empty())
+				words.push_back(word);
+
+			return words;
 		}
 
-	private:
-		bool isInitialized;
-		bool isInstalled;
+		// Removes a trailing "@<reg>" from a declaration and returns the register
+		static std::optional<Location> ExtractRegister(std::string& declaration)
+		{
+			const auto start = declaration.find("@<");
+			if (start == std::string::npos)
+				return std::nullopt;
 
-		uint8_t opCodeSize;
-		Function<Signature, ReturnType, ArgumentTypes...> originalFunction;
-		uintptr_t userHookFunctionAddress;
+			const auto end = declaration.find('>', start);
+			if (end == std::string::npos)
+				throw std::invalid_argument("Unterminated register in " + declaration);
 
-		uintptr_t trampolineAddress;
-		uint32_t trampolineSize;
+			const auto name = ToLower(declaration.substr(start + 2, end - start - 2));
+			declaration.erase(start, end - start + 1);
 
-		uintptr_t hookWrapperAddress;
-		std::uint32_t tempStorage[128];
+			static const std::pair<const char*, Location> registers[] =
+			{
+				{ "eax", Location::EAX }, { "ebx", Location::EBX }, { "ecx", Location::ECX },
+				{ "edx", Location::EDX }, { "esi", Location::ESI }, { "edi", Location::EDI },
+				{ "st0", Location::ST0 }, { "st", Location::ST0 }
+			};
+			for (const auto& [registerName, location] : registers)
+			{
+				if (name == registerName)
+					return location;
+			}
 
-		static constexpr uint32_t MAX_HOOK_WRAPPER_CODE_SIZE = 512;
-		static constexpr uint8_t SIZE_OF_JUMP = 5;
+			throw std::invalid_argument("Unsupported register: " + name);
+		}
 
-		static void WriteJump(const std::uintptr_t address, const std::uintptr_t target)
+		// Only 32-bit values are supported, as everything is passed around as words
+		static TypeClass ClassifyType(const std::vector<std::string>& words)
 		{
-			DWORD oldProtection;
-			VirtualProtect((void*)address, SIZE_OF_JUMP, PAGE_EXECUTE_READWRITE, &oldProtection);
+			if (std::find(words.begin(), words.end(), "*") != words.end())
+				return TypeClass::Integer;
 
-			const auto relativeJumpOffset = target - address - SIZE_OF_JUMP;
+			if (std::find(words.begin(), words.end(), "&") != words.end())
+				return TypeClass::Integer;
 
-			*(uint8_t*)address = 0xE9;
-			*(uint32_t*)(address + 1) = relativeJumpOffset;
+			const auto longCount = std::count(words.begin(), words.end(), "long");
+			for (const auto& word : words)
+			{
+				if (word == "double" || word == "__int64" || word == "int64_t" || word == "uint64_t" || longCount > 1)
+					throw std::invalid_argument("Only 32-bit arguments and return values are supported");
+
+				if (word == "float")
+					return TypeClass::Float;
+			}
+			return TypeClass::Integer;
 		}
 
-		void SetupTrampoline()
+		// Throws for conventions that can't be represented yet, i.e. all those where the callee cleans up the stack
+		static bool IsCallingConvention(const std::string& word)
 		{
-			trampolineSize = opCodeSize + SIZE_OF_JUMP;
-
-			trampolineAddress = (uintptr_t)VirtualAlloc(nullptr, trampolineSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-			std::memcpy((void*)trampolineAddress, (void*)originalFunction.GetAddress(), opCodeSize);
+			// __usercall is cdecl with custom locations
+			if (word == "__cdecl" || word == "__usercall")
+				return true;
 
-			WriteJump(trampolineAddress + opCodeSize, originalFunction.GetAddress() + opCodeSize);
+			for (const char* convention : { "__stdcall", "__fastcall", "__thiscall", "__userpurge", "__pascal", "__vectorcall", "__clrcall" })
+			{
+				if (word == convention)
+					throw std::invalid_argument("Unsupported calling convention: " + word);
+			}
+			return false;
 		}
+	};
 
-		void SetupHookWrapper()
-		{
-			hookWrapperAddress = (uintptr_t)VirtualAlloc(nullptr, MAX_HOOK_WRAPPER_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	// Generated code calling a function with a layout only known at runtime: uint32_t __cdecl(const uint32_t* arguments, uintptr_t function).
+	// Like the hook wrapper it only depends on the layout, so one copy is shared by every function with the same one.
+	class CallStub
+	{
+	public:
+		using Type = uint32_t(__cdecl*)(const uint32_t* arguments, uintptr_t functionAddress);
 
+		static Type GetShared(const RuntimeSignature& signature)
+		{
+			std::string key;
+			for (const Location location : signature.GetArgumentLocations())
+			{
+				key.push_back((char)location);
+			}
+			key.push_back((char)signature.GetReturnValueLocation());
 
-			std::vector<uint8_t> hookWrapperBytes;
+			static std::mutex mutex;
+			static auto* stubs = new std::unordered_map<std::string, uintptr_t>();
 
-			// Pop the return address
+			std::lock_guard lock(mutex);
+			auto stub = stubs->find(key);
+			if (stub == stubs->end())
 			{
-				const auto address = (uintptr_t)&tempStorage[0];
-				hookWrapperBytes.push_back(0x8F);
-				hookWrapperBytes.push_back(0x05);
-				hookWrapperBytes.push_back(Utils::GetLowByte(address));
-				hookWrapperBytes.push_back(Utils::GetHighByte(address));
-				hookWrapperBytes.push_back(Utils::GetLowByte(address >> 16));
-				hookWrapperBytes.push_back(Utils::GetHighByte(address >> 16));
+				stub = stubs->emplace(key, Generate(signature)).first;
 			}
+			return (Type)stub->second;
+		}
+
+	private:
+		static constexpr uint32_t MAX_CALL_STUB_CODE_SIZE = 512;
 
-			const uint32_t stackArgumentCount = Signature::GetStackArgumentIndices().size();
-			for (uint32_t i = 0; i < stackArgumentCount; i++)
+		// Appends a ModRM byte for [ebp + displacement], followed by the displacement
+		static void AppendEbpOperand(std::vector<uint8_t>& bytes, const uint8_t reg, const uint32_t displacement)
+		{
+			if (displacement <= 0x7F)
+			{
+				bytes.push_back(0x45 | (reg << 3));
+				bytes.push_back((uint8_t)displacement);
+			}
+			else
 			{
-				// Write pop to local storage location
-				const auto address = (uintptr_t)&tempStorage[i + 1];
-				hookWrapperBytes.push_back(0x8F);
-				hookWrapperBytes.push_back(0x05);
-				hookWrapperBytes.push_back(Utils::GetLowByte(address));
-				hookWrapperBytes.push_back(Utils::GetHighByte(address));
-				hookWrapperBytes.push_back(Utils::GetLowByte(address >> 16));
-				hookWrapperBytes.push_back(Utils::GetHighByte(address >> 16));
+				bytes.push_back(0x85 | (reg << 3));
+				Utils::AppendUInt32(bytes, displacement);
 			}
+		}
 
+		static uintptr_t Generate(const RuntimeSignature& signature)
+		{
+			const auto& argumentLocations = signature.GetArgumentLocations();
+			const auto stubAddress = ExecutableMemory::Allocate(MAX_CALL_STUB_CODE_SIZE);
 
-			// Push all registers
-			hookWrapperBytes.push_back(0x60);
+			std::vector<uint8_t> bytes;
 
-			// Write a push for each argument
-			auto argumentLocations = Signature::GetArgumentLocations();
-			std::reverse(argumentLocations.begin(), argumentLocations.end());
-			uint32_t stackWriteIndex = 0;
-			for (const Location location : argumentLocations)
+			// pushad; mov ebp, [esp + 36] (the arguments)
+			bytes.push_back(0x60);
+			bytes.insert(bytes.end(), { 0x8B, 0x6C, 0x24, 0x24 });
+
+			// push dword ptr [ebp + 4 * index] for each stack argument, last one first
+			uint32_t pushedArgumentCount = 0;
+			for (int32_t i = (int32_t)argumentLocations.size() - 1; i >= 0; i--)
 			{
-				switch (location)
-				{
-				case Location::Stack:
+				if (argumentLocations[i] == Location::Stack)
 				{
-					const auto address = (uintptr_t)&tempStorage[stackArgumentCount - stackWriteIndex++];
-					hookWrapperBytes.push_back(0xFF);
-					hookWrapperBytes.push_back(0x35);
-					hookWrapperBytes.push_back(Utils::GetLowByte(address));
-					hookWrapperBytes.push_back(Utils::GetHighByte(address));
-					hookWrapperBytes.push_back(Utils::GetLowByte(address >> 16));
-					hookWrapperBytes.push_back(Utils::GetHighByte(address >> 16));
+					bytes.push_back(0xFF);
+					AppendEbpOperand(bytes, 6, 4 * i);
+					pushedArgumentCount++;
 				}
-					break;
-				case Location::EAX:
-					hookWrapperBytes.push_back(0x50);
-					break;
-				case Location::EBX:
-					hookWrapperBytes.push_back(0x53);
-					break;
-				case Location::ECX:
-					hookWrapperBytes.push_back(0x51);
-					break;
-				case Location::EDX:
-					hookWrapperBytes.push_back(0x52);
-					break;
-				case Location::ESI:
-					hookWrapperBytes.push_back(0x56);
-					break;
-				case Location::EDI:
-					hookWrapperBytes.push_back(0x57);
-					break;
-				default:
-					throw std::exception("Not yet implemented");
+			}
+
+			// mov reg, [ebp + 4 * index]
+			for (uint32_t i = 0; i < argumentLocations.size(); i++)
+			{
+				if (argumentLocations[i] != Location::Stack)
+				{
+					bytes.push_back(0x8B);
+					AppendEbpOperand(bytes, LocationUtils::GetRegisterNumber(argumentLocations[i]), 4 * i);
 				}
 			}
 
-			// Write call
-			hookWrapperBytes.push_back(0xE8);
-			const auto relativeCallOffset = userHookFunctionAddress - (hookWrapperAddress + hookWrapperBytes.size() - 1) - 5;
-			hookWrapperBytes.push_back(Utils::GetLowByte(relativeCallOffset));
-			hookWrapperBytes.push_back(Utils::GetHighByte(relativeCallOffset));
-			hookWrapperBytes.push_back(Utils::GetLowByte(relativeCallOffset >> 16));
-			hookWrapperBytes.push_back(Utils::GetHighByte(relativeCallOffset >> 16));
+			// call dword ptr [esp + 32 (pushad) + 4 (return address) + 4 (arguments) + 4 * pushed]
+			const uint32_t functionDisplacement = 40 + 4 * pushedArgumentCount;
+			bytes.push_back(0xFF);
+			if (functionDisplacement <= 0x7F)
+			{
+				bytes.insert(bytes.end(), { 0x54, 0x24 });
+				bytes.push_back((uint8_t)functionDisplacement);
+			}
+			else
+			{
+				bytes.insert(bytes.end(), { 0x94, 0x24 });
+				Utils::AppendUInt32(bytes, functionDisplacement);
+			}
 
 			// add esp, X
-			hookWrapperBytes.push_back(0x83);
-			hookWrapperBytes.push_back(0xC4);
-			hookWrapperBytes.push_back((uint8_t)argumentLocations.size() * 4);
-
-			// Save EAX to tempStorage
-			const auto eaxStorageAddress = (uintptr_t)&tempStorage[1];
-			hookWrapperBytes.push_back(0xA3);
-			hookWrapperBytes.push_back(Utils::GetLowByte(eaxStorageAddress));
-			hookWrapperBytes.push_back(Utils::GetHighByte(eaxStorageAddress));
-			hookWrapperBytes.push_back(Utils::GetLowByte(eaxStorageAddress >> 16));
-			hookWrapperBytes.push_back(Utils::GetHighByte(eaxStorageAddress >> 16));
-			
-
-			// Pop all registers
-			hookWrapperBytes.push_back(0x61);
+			if (CallingConventionUtils::SpecifiesCallerCleanup(signature.GetCallingConvention()) && pushedArgumentCount > 0)
+			{
+				bytes.insert(bytes.end(), { 0x81, 0xC4 });
+				Utils::AppendUInt32(bytes, pushedArgumentCount * 4);
+			}
 
-			// Put return value where it needs to go
-			// We sort of assume the user's hook function itself to be CDECL
-			auto returnValueLocation = std::is_floating_point<ReturnType>() ? Location::ST0 : Location::EAX;
-			if (returnValueLocation == Location::EAX)
+			// Hand the return value back in eax by overwriting eax's slot of the pushad frame
+			if (signature.GetReturnValueLocation() == Location::ST0)
 			{
-				switch (Signature::GetReturnValueLocation())
-				{
-				case Location::EAX:
-					hookWrapperBytes.push_back(0xA1);
-					break;
-				case Location::EBX:
-					hookWrapperBytes.push_back(0x8B);
-					hookWrapperBytes.push_back(0x1D);
-					break;
-				case Location::ECX:
-					hookWrapperBytes.push_back(0x8B);
-					hookWrapperBytes.push_back(0x0D);
-					break;
-				case Location::EDX:
-					hookWrapperBytes.push_back(0x8B);
-					hookWrapperBytes.push_back(0x15);
-					break;
-				case Location::ESI:
-					hookWrapperBytes.push_back(0x8B);
-					hookWrapperBytes.push_back(0x35);
-					break;
-				case Location::EDI:
-					hookWrapperBytes.push_back(0x8B);
-					hookWrapperBytes.push_back(0x3D);
-					break;
-				// TODO: Handle 8-bit registers
-				default:
-					throw std::exception("Return value location not implemented");
+				// fstp dword ptr [esp + 28]
+				bytes.insert(bytes.end(), { 0xD9, 0x5C, 0x24, 0x1C });
+			}
+			else
+			{
+				// mov [esp + 28], reg
+				bytes.push_back(0x89);
+				bytes.push_back(0x44 | (LocationUtils::GetRegisterNumber(signature.GetReturnValueLocation()) << 3));
+				bytes.insert(bytes.end(), { 0x24, 0x1C });
+			}
+
+			// popad; ret
+			bytes.push_back(0x61);
+			bytes.push_back(0xC3);
+
+			if (bytes.size() > MAX_CALL_STUB_CODE_SIZE)
+				throw std::logic_error("Call stub byte size was larger than MAX_CALL_STUB_CODE_SIZE");
+
+			std::memcpy((void*)stubAddress, bytes.data(), bytes.size());
+			SymbolMap::Register(stubAddress, bytes.size(), "Unconventional::CallStub" + signature.Describe());
+			return stubAddress;
+		}
+	};
+
+	// Function with a RuntimeSignature. Arguments and the return value are passed as 32-bit words.
+	class RuntimeFunction
+	{
+	public:
+		RuntimeFunction(const uintptr_t address, const RuntimeSignature& signature)
+			: address(address), argumentCount((uint32_t)signature.GetArgumentLocations().size()), stub(CallStub::GetShared(signature))
+		{
+		}
+
+		uintptr_t GetAddress() const { return address; }
+
+		// Float return values come back as their bit pattern, unless ReturnType is float
+		template<typename ReturnType = uint32_t>
+		ReturnType Call(const std::vector<uint32_t>& arguments) const
+		{
+			static_assert(sizeof(ReturnType) <= sizeof(uint32_t), "Return values have to fit into 32 bits");
+
+			if (arguments.size() != argumentCount)
+				throw std::invalid_argument("Amount of arguments does not match the signature");
+
+			const uint32_t returnValue = stub(arguments.data(), address);
+			return *(ReturnType*)&returnValue;
+		}
+
+	private:
+		uintptr_t address;
+		uint32_t argumentCount;
+		CallStub::Type stub;
+	};
+
+	// Collects the argument words a hooked function is called with, so they can be replayed offline.
+	// Capture files consist of a RecordingHeader followed by argumentCount words per call.
+	struct RecordingHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t argumentCount;
+		uint32_t callCount;
+
+		static constexpr uint32_t MAGIC = 0x52524355; // "UCRR"
+		static constexpr uint32_t VERSION = 1;
+	};
+
+	class ArgumentRecorder
+	{
+	public:
+		ArgumentRecorder(const uint32_t argumentCount) : isCapturing(false), argumentCount(argumentCount), maxCallCount(0), callCount(0)
+		{
+			static_assert(sizeof(isCapturing) == 1, "The hook wrapper reads isCapturing as a single byte");
+		}
+
+		void Start(const std::string& capturePath, const uint32_t maxCalls)
+		{
+			std::lock_guard lock(mutex);
+
+			path = capturePath;
+			maxCallCount = maxCalls;
+			callCount = 0;
+			words.clear();
+			isCapturing = true;
+		}
+
+		void Stop()
+		{
+			std::lock_guard lock(mutex);
+
+			if (!isCapturing)
+				return;
+			isCapturing = false;
+
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+			if (!file)
+				throw std::runtime_error("Could not open capture file " + path + " for writing");
+
+			const RecordingHeader header{ RecordingHeader::MAGIC, RecordingHeader::VERSION, argumentCount, callCount };
+			file.write((const char*)&header, sizeof(header));
+			file.write((const char*)words.data(), words.size() * sizeof(uint32_t));
+
+			words.clear();
+			words.shrink_to_fit();
+		}
+
+		// Called by the hook wrapper with the arguments it is about to pass to the user hook
+		static void __cdecl Record(ArgumentRecorder* recorder, const uint32_t* arguments)
+		{
+			std::lock_guard lock(recorder->mutex);
+
+			if (!recorder->isCapturing || recorder->callCount >= recorder->maxCallCount)
+				return;
+
+			recorder->words.insert(recorder->words.end(), arguments, arguments + recorder->argumentCount);
+			recorder->callCount++;
+		}
+
+		uintptr_t GetIsCapturingAddress() const { return (uintptr_t)&isCapturing; }
+
+	private:
+		std::atomic<bool> isCapturing;
+		uint32_t argumentCount;
+		uint32_t maxCallCount;
+		uint32_t callCount;
+
+		std::mutex mutex;
+		std::string path;
+		std::vector<uint32_t> words;
+	};
+
+	class Recording
+	{
+	public:
+		Recording(const std::string& path)
+		{
+			std::ifstream file(path, std::ios::binary);
+			if (!file)
+				throw std::runtime_error("Could not open capture file " + path);
+
+			RecordingHeader header{};
+			file.read((char*)&header, sizeof(header));
+			if (!file || header.magic != RecordingHeader::MAGIC || header.version != RecordingHeader::VERSION)
+				throw std::runtime_error("File " + path + " is not a capture file");
+
+			argumentCount = header.argumentCount;
+			callCount = header.callCount;
+
+			words.resize((size_t)argumentCount * callCount);
+			file.read((char*)words.data(), words.size() * sizeof(uint32_t));
+			if (!file)
+				throw std::runtime_error("Capture file " + path + " is truncated");
+		}
+
+		uint32_t GetArgumentCount() const { return argumentCount; }
+		uint32_t GetCallCount() const { return callCount; }
+		const uint32_t* GetArguments(const uint32_t call) const { return words.data() + (size_t)call * argumentCount; }
+
+	private:
+		uint32_t argumentCount;
+		uint32_t callCount;
+		std::vector<uint32_t> words;
+	};
+
+	enum class CacheState
+	{
+		// Calls run back to back after an untimed warm-up pass
+		Warm,
+		// Caches are thrashed before every call, and only the calls themselves are timed
+		Cold
+	};
+
+	struct ReplayResult
+	{
+		uint32_t callCount;
+		double totalSeconds;
+		double nanosecondsPerCall;
+	};
+
+	namespace ReplayUtils
+	{
+		template<typename ReturnType, typename... ArgumentTypes, typename Function, size_t... indices>
+		ReturnType CallWithWords(Function& function, const uint32_t* words, std::index_sequence<indices...>)
+		{
+			return function.Call(*(ArgumentTypes*)&words[indices]...);
+		}
+
+		static void ThrashCaches()
+		{
+			// Larger than the last level cache of most machines
+			constexpr size_t THRASH_BUFFER_SIZE = 64 * 1024 * 1024;
+			static std::vector<uint8_t> buffer(THRASH_BUFFER_SIZE);
+
+			for (size_t i = 0; i < buffer.size(); i += 64)
+			{
+				buffer[i]++;
+			}
+		}
+	}
+
+	// Drives a function with recorded arguments and measures how long the calls take
+	template<typename Signature, typename ReturnType, typename... ArgumentTypes>
+	ReplayResult Replay(Function<Signature, ReturnType, ArgumentTypes...>& function, const Recording& recording, const uint32_t passes, const CacheState cacheState)
+	{
+		if (recording.GetArgumentCount() != sizeof...(ArgumentTypes))
+			throw std::invalid_argument("Recording argument count does not match the function");
+
+		const auto indices = std::index_sequence_for<ArgumentTypes...>();
+		const auto callCount = recording.GetCallCount();
+		std::chrono::steady_clock::duration total{};
+
+		if (cacheState == CacheState::Warm)
+		{
+			for (uint32_t call = 0; call < callCount; call++)
+			{
+				ReplayUtils::CallWithWords<ReturnType, ArgumentTypes...>(function, recording.GetArguments(call), indices);
+			}
+
+			const auto start = std::chrono::steady_clock::now();
+			for (uint32_t pass = 0; pass < passes; pass++)
+			{
+				for (uint32_t call = 0; call < callCount; call++)
+				{
+					ReplayUtils::CallWithWords<ReturnType, ArgumentTypes...>(function, recording.GetArguments(call), indices);
 				}
-				hookWrapperBytes.push_back(Utils::GetLowByte(eaxStorageAddress));
-				hookWrapperBytes.push_back(Utils::GetHighByte(eaxStorageAddress));
-				hookWrapperBytes.push_back(Utils::GetLowByte(eaxStorageAddress >> 16));
-				hookWrapperBytes.push_back(Utils::GetHighByte(eaxStorageAddress >> 16));
 			}
-			else if (returnValueLocation == Location::ST0)
+			total = std::chrono::steady_clock::now() - start;
+		}
+		else
+		{
+			for (uint32_t pass = 0; pass < passes; pass++)
+			{
+				for (uint32_t call = 0; call < callCount; call++)
+				{
+					ReplayUtils::ThrashCaches();
+
+					const auto start = std::chrono::steady_clock::now();
+					ReplayUtils::CallWithWords<ReturnType, ArgumentTypes...>(function, recording.GetArguments(call), indices);
+					total += std::chrono::steady_clock::now() - start;
+				}
+			}
+		}
+
+		const uint32_t totalCalls = callCount * passes;
+		const double totalSeconds = std::chrono::duration<double>(total).count();
+		return { totalCalls, totalSeconds, totalCalls > 0 ? totalSeconds * 1e9 / totalCalls : 0.0 };
+	}
+
+	// Defers freeing hook code and contexts until no thread can still be running in or reading them (quiescent-state based
+	// reclamation). The shared hook wrapper counts entries and exits in a per-thread record with plain increments.
+	// Retired blocks are queued and checked together: one pass suspends the other threads once to see which of them may be
+	// inside a hook, and a block is released once each of those has been seen outside of it, finished its outermost hook call or exited.
+	class Reclaimer
+	{
+	public:
+		struct Range
+		{
+			uintptr_t address;
+			size_t size;
+		};
+
+		// Written only by its own thread, from the shared hook wrapper, except for bits of released hook ids
+		struct ThreadRecord
+		{
+			// Hook calls the thread is inside of
+			uint32_t nesting;
+
+			// Outermost hook calls the thread has finished
+			uint32_t generation;
+
+			DWORD threadId;
+			HANDLE thread;
+
+			// Bitmap of the hook ids disabled on this thread, read by the entry stubs
+			std::atomic<uint32_t>* disabledHookWords;
+			uint32_t disabledHookWordCount;
+		};
+
+		// Runs release once no thread is inside a hook call it was in at the time of retiring, or executing any of ranges.
+		// The code must already be unreachable for new calls, i.e. uninstalled. The block is only queued; a pass over all
+		// queued blocks runs once enough of them piled up, or whenever Collect is called. Runs from destructors, so never throws.
+		static void Retire(std::vector<Range> ranges, std::function<void()> release)
+		{
+			auto& state = GetState();
+
+			bool isCollecting;
+			{
+				std::lock_guard lock(state.mutex);
+				state.retiredBlocks.push_back({ std::move(ranges), std::move(release), {}, false });
+				isCollecting = state.retiredBlocks.size() >= state.collectThreshold;
+			}
+
+			if (isCollecting)
+				Collect();
+		}
+
+		// Checks all queued blocks in one pass and releases whatever became safe to release. Returns the number of blocks still waiting.
+		static size_t Collect()
+		{
+			auto& state = GetState();
+
+			std::vector<std::function<void()>> releases;
+			size_t pendingCount;
 			{
-				// Pop all registers
-				hookWrapperBytes.push_back(0x61);
+				std::unique_lock lock(state.mutex);
+				PruneRecords(state);
 
-				switch (Signature::GetReturnValueLocation())
+				if (!state.retiredBlocks.empty())
+					CheckBlocks(state, lock);
+
+				auto block = state.retiredBlocks.begin();
+				while (block != state.retiredBlocks.end())
 				{
-				case Location::ST0:
-					break;
-				// TODO: Implement these on-demand
-				default:
-					throw std::exception("Floating-point return value location not implemented");
+					if (!block->isChecked || !block->waits.empty())
+					{
+						++block;
+						continue;
+					}
+
+					releases.push_back(std::move(block->release));
+					block = state.retiredBlocks.erase(block);
+				}
+				pendingCount = state.retiredBlocks.size();
+
+				// Blocks held by long running calls don't make every later Retire run a pass
+				state.collectThreshold = std::max(MIN_COLLECT_THRESHOLD, 2 * pendingCount);
+			}
+
+			// Releasing frees memory and takes other locks, so it happens outside of ours
+			for (auto& release : releases)
+				release();
+
+			return pendingCount;
+		}
+
+		static DWORD GetTlsIndex()
+		{
+			return GetState().tlsIndex;
+		}
+
+		// Non-zero while a thread is between entering its first hook call and having a record
+		static uintptr_t GetPendingRegistrationsAddress()
+		{
+			return (uintptr_t)&GetState().pendingRegistrations;
+		}
+
+		// Called by the shared wrapper on a thread's first hook call. The record already counts that call.
+		static ThreadRecord* __cdecl RegisterCurrentThread()
+		{
+			return AddRecord(1);
+		}
+
+		// Called by the shared wrapper instead of calling the user hook directly, with the hook's argumentCount arguments following
+		// on the stack. An exception unwinding through the wrapper skips its AppendLeave, so the count is given back here instead.
+		// Returns whatever the hook left in edx:eax; a value in ST0 is left alone, as nothing here uses the FPU.
+		static uint64_t __cdecl CallUserHook(const uintptr_t function, const uint32_t argumentCount, ...)
+		{
+			const auto* arguments = &argumentCount + 1;
+			uint32_t low = 0;
+			uint32_t high = 0;
+
+			__try
+			{
+				__asm
+				{
+					mov ecx, argumentCount
+					mov esi, arguments
+				pushArgument:
+					test ecx, ecx
+					jz callHook
+					dec ecx
+					push dword ptr [esi + ecx * 4]
+					jmp pushArgument
+				callHook:
+					call function
+					mov low, eax
+					mov high, edx
+					mov ecx, argumentCount
+					lea esp, [esp + ecx * 4]
 				}
 			}
+			__finally
+			{
+				if (AbnormalTermination())
+					LeaveAfterUnwind();
+			}
+
+			return ((uint64_t)high << 32) | low;
+		}
+
+		// Hooks are numbered, so a single TLS slot per thread is enough to tell which of them are disabled there
+		static uint32_t AllocateHookId()
+		{
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+
+			if (state.freeHookIds.empty())
+				return state.nextHookId++;
+
+			const auto id = state.freeHookIds.back();
+			state.freeHookIds.pop_back();
+			return id;
+		}
+
+		// The hook's code has to be unreachable, as the id is cleared in every thread and handed to the next hook
+		static void ReleaseHookId(const uint32_t id)
+		{
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+
+			for (auto* record : state.records)
+			{
+				if (id / 32 < record->disabledHookWordCount)
+					record->disabledHookWords[id / 32].fetch_and(~(1u << (id % 32)), std::memory_order_relaxed);
+			}
+			state.freeHookIds.push_back(id);
+		}
+
+		static void SetHookDisabledOnCurrentThread(const uint32_t id, const bool disabled)
+		{
+			auto& state = GetState();
+			auto* record = (ThreadRecord*)TlsGetValue(state.tlsIndex);
+			if (record == nullptr)
+			{
+				if (!disabled)
+					return;
+				record = AddRecord(0);
+			}
+
+			// Words are only replaced by their own thread, and only under the lock ReleaseHookId writes them with,
+			// so flipping a bit in place just has to be atomic
+			const auto wordIndex = id / 32;
+			if (wordIndex >= record->disabledHookWordCount)
+			{
+				if (!disabled)
+					return;
+
+				std::lock_guard lock(state.mutex);
+
+				const auto wordCount = std::max(wordIndex + 1, record->disabledHookWordCount * 2);
+				auto* words = new std::atomic<uint32_t>[wordCount]{};
+				for (uint32_t i = 0; i < record->disabledHookWordCount; i++)
+					words[i].store(record->disabledHookWords[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+				delete[] record->disabledHookWords;
+				record->disabledHookWords = words;
+				record->disabledHookWordCount = wordCount;
+			}
+
+			if (disabled)
+				record->disabledHookWords[wordIndex].fetch_or(1u << (id % 32), std::memory_order_relaxed);
 			else
+				record->disabledHookWords[wordIndex].fetch_and(~(1u << (id % 32)), std::memory_order_relaxed);
+		}
+
+		static bool IsHookDisabledOnCurrentThread(const uint32_t id)
+		{
+			const auto* record = (const ThreadRecord*)TlsGetValue(GetTlsIndex());
+			return record != nullptr && id / 32 < record->disabledHookWordCount && (record->disabledHookWords[id / 32].load(std::memory_order_relaxed) & (1u << (id % 32))) != 0;
+		}
+
+		// Code in which a thread may be about to enter a hook call without having counted it yet
+		static void AddGuardedRange(const Range range)
+		{
+			auto& state = GetState();
+			std::lock_guard lock(state.mutex);
+			state.guardedRanges.push_back(range);
+		}
+
+		// Emits the counting of a hook call, right after the pushad that starts generated code at codeAddress.
+		// Clobbers nothing: eax, ecx and edx are restored from the pushad frame.
+		static void AppendEnter(std::vector<uint8_t>& bytes, const uintptr_t codeAddress)
+		{
+			static_assert(offsetof(ThreadRecord, nesting) == 0 && offsetof(ThreadRecord, generation) == 4, "Generated code addresses the record's counters directly");
+
+			// mov eax, <record>; test eax, eax; jnz L1
+			Utils::AppendLoadTlsSlot(bytes, GetTlsIndex());
+			bytes.insert(bytes.end(), { 0x85, 0xC0, 0x75, 0x15 });
+
+			// First hook call on this thread: lock inc [pendingRegistrations]; call RegisterCurrentThread; lock dec [pendingRegistrations]; jmp L2
+			bytes.insert(bytes.end(), { 0xF0, 0xFF, 0x05 });
+			Utils::AppendUInt32(bytes, GetPendingRegistrationsAddress());
+			Utils::AppendRelative(bytes, 0xE8, codeAddress, (uintptr_t)&RegisterCurrentThread);
+			bytes.insert(bytes.end(), { 0xF0, 0xFF, 0x0D });
+			Utils::AppendUInt32(bytes, GetPendingRegistrationsAddress());
+			bytes.insert(bytes.end(), { 0xEB, 0x02 });
+
+			// L1: inc dword ptr [eax + nesting]
+			bytes.insert(bytes.end(), { 0xFF, 0x00 });
+
+			// L2: until here, a thread may hold a context without having counted the call
+			AddGuardedRange({ codeAddress, bytes.size() });
+
+			// mov eax, [esp + 28]; mov ecx, [esp + 24]; mov edx, [esp + 20]
+			bytes.insert(bytes.end(), { 0x8B, 0x44, 0x24, 0x1C });
+			bytes.insert(bytes.end(), { 0x8B, 0x4C, 0x24, 0x18 });
+			bytes.insert(bytes.end(), { 0x8B, 0x54, 0x24, 0x14 });
+		}
+
+		// Emits the end of a hook call counted by AppendEnter. Clobbers eax.
+		static void AppendLeave(std::vector<uint8_t>& bytes)
+		{
+			// mov eax, <record>; dec dword ptr [eax + nesting]; jnz L1; inc dword ptr [eax + generation]; L1:
+			Utils::AppendLoadTlsSlot(bytes, GetTlsIndex());
+			bytes.insert(bytes.end(), { 0xFF, 0x08, 0x75, 0x03, 0xFF, 0x40, 0x04 });
+		}
+
+		// Emits a jump to target, taken when the hook id is disabled on the calling thread. Clobbers nothing.
+		static void AppendDisabledCheck(std::vector<uint8_t>& bytes, const uintptr_t codeAddress, const uint32_t hookId, const uintptr_t target)
+		{
+			static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free, "Generated code reads the bitmap words as plain dwords");
+			static_assert(offsetof(ThreadRecord, disabledHookWordCount) < 0x80 && offsetof(ThreadRecord, disabledHookWords) < 0x80, "Generated code addresses the bitmap with 8 bit displacements");
+
+			// push eax; mov eax, <record>; test eax, eax; jz L1
+			bytes.push_back(0x50);
+			Utils::AppendLoadTlsSlot(bytes, GetTlsIndex());
+			bytes.insert(bytes.end(), { 0x85, 0xC0, 0x74, 0x1E });
+
+			// cmp dword ptr [eax + disabledHookWordCount], wordIndex; jbe L1
+			bytes.insert(bytes.end(), { 0x81, 0x78, (uint8_t)offsetof(ThreadRecord, disabledHookWordCount) });
+			Utils::AppendUInt32(bytes, hookId / 32);
+			bytes.insert(bytes.end(), { 0x76, 0x15 });
+
+			// mov eax, [eax + disabledHookWords]; test dword ptr [eax + 4 * wordIndex], bit; jz L1
+			bytes.insert(bytes.end(), { 0x8B, 0x40, (uint8_t)offsetof(ThreadRecord, disabledHookWords) });
+			bytes.insert(bytes.end(), { 0xF7, 0x80 });
+			Utils::AppendUInt32(bytes, 4 * (hookId / 32));
+			Utils::AppendUInt32(bytes, 1u << (hookId % 32));
+			bytes.insert(bytes.end(), { 0x74, 0x06 });
+
+			// pop eax; jmp target
+			bytes.push_back(0x58);
+			Utils::AppendRelative(bytes, 0xE9, codeAddress, target);
+
+			// L1: pop eax
+			bytes.push_back(0x58);
+		}
+
+	private:
+		struct Wait
+		{
+			DWORD threadId;
+			uint32_t generation;
+
+			// Seen inside a hook call, so a changed generation means it has finished
+			bool isCounted;
+		};
+
+		struct RetiredBlock
+		{
+			std::vector<Range> ranges;
+			std::function<void()> release;
+
+			// Threads that may still use the block, as of the last pass
+			std::vector<Wait> waits;
+			bool isChecked;
+		};
+
+		struct Observation
+		{
+			DWORD threadId;
+			bool isGone;
+			bool isKnown;
+			uint32_t nesting;
+			uint32_t generation;
+			uintptr_t eip;
+		};
+
+		static constexpr size_t MIN_COLLECT_THRESHOLD = 64;
+		static constexpr uint32_t MAX_SUSPEND_ATTEMPTS = 100;
+
+		struct State
+		{
+			std::mutex mutex;
+			DWORD tlsIndex;
+			std::atomic<uint32_t> pendingRegistrations{ 0 };
+
+			std::vector<ThreadRecord*> records;
+			std::vector<Range> guardedRanges;
+			std::vector<RetiredBlock> retiredBlocks;
+
+			uint32_t nextHookId = 0;
+			std::vector<uint32_t> freeHookIds;
+
+			size_t collectThreshold = MIN_COLLECT_THRESHOLD;
+
+			State() : tlsIndex(TlsAlloc())
 			{
-				throw std::logic_error("Return value location for CDECL function was neither EAX nor ST0");
+				if (tlsIndex == TLS_OUT_OF_INDEXES)
+					throw std::runtime_error("Could not allocate a TLS slot for thread records");
 			}
+		};
+
+		// Never destroyed, as hooks with static storage duration are retired after it would have been
+		static State& GetState()
+		{
+			static State* state = new State();
+			return *state;
+		}
 
-			// sub esp, X
-			hookWrapperBytes.push_back(0x83);
-			hookWrapperBytes.push_back(0xEC);
-			hookWrapperBytes.push_back((uint8_t)stackArgumentCount * 4);
+		static ThreadRecord* AddRecord(const uint32_t nesting)
+		{
+			auto& state = GetState();
 
-			// Push return address to top of stack again
+			const auto threadId = GetCurrentThreadId();
+			auto* record = new ThreadRecord{ nesting, 0, threadId, OpenThread(SYNCHRONIZE, FALSE, threadId), nullptr, 0 };
 			{
-				const auto address = (uintptr_t)&tempStorage[0];
-				hookWrapperBytes.push_back(0xFF);
-				hookWrapperBytes.push_back(0x35);
-				hookWrapperBytes.push_back(Utils::GetLowByte(address));
-				hookWrapperBytes.push_back(Utils::GetHighByte(address));
-				hookWrapperBytes.push_back(Utils::GetLowByte(address >> 16));
-				hookWrapperBytes.push_back(Utils::GetHighByte(address >> 16));
+				std::lock_guard lock(state.mutex);
+				state.records.push_back(record);
 			}
+			TlsSetValue(state.tlsIndex, record);
+			return record;
+		}
 
-			// Write Return
-			hookWrapperBytes.push_back(0xC3);
+		static bool IsInAny(const uintptr_t address, const std::vector<Range>& ranges)
+		{
+			return std::any_of(ranges.begin(), ranges.end(), [&](const Range& range) { return address - range.address < range.size; });
+		}
 
-			// Write hook wrapper to memory
-			if (hookWrapperBytes.size() > MAX_HOOK_WRAPPER_CODE_SIZE)
-				throw std::logic_error("Hook Wrapper Function byte size was larger than MAX_HOOK_WRAPPER_CODE_SIZE");
+		static const ThreadRecord* FindRecord(const State& state, const DWORD threadId)
+		{
+			for (const auto* record : state.records)
+			{
+				if (record->threadId == threadId)
+					return record;
+			}
+			return nullptr;
+		}
 
-			std::memcpy((void*)hookWrapperAddress, hookWrapperBytes.data(), hookWrapperBytes.size());
+		static void LeaveAfterUnwind()
+		{
+			auto* record = (ThreadRecord*)TlsGetValue(GetTlsIndex());
+			if (--record->nesting == 0)
+				record->generation++;
 		}
-		
+
+		// Records keep their thread's handle open, so a thread id is never shared by a live and a dead record
+		static void PruneRecords(State& state)
+		{
+			auto record = state.records.begin();
+			while (record != state.records.end())
+			{
+				if (WaitForSingleObject((*record)->thread, 0) == WAIT_OBJECT_0)
+				{
+					CloseHandle((*record)->thread);
+					delete[] (*record)->disabledHookWords;
+					delete *record;
+					record = state.records.erase(record);
+				}
+				else
+				{
+					++record;
+				}
+			}
+		}
+
+		// Suspends the other threads once to see where each of them is, or returns false to try again in a later pass.
+		// The lock is dropped while waiting for a registration, as the registering thread needs it to add its record.
+		static bool Observe(State& state, std::unique_lock<std::mutex>& lock, std::vector<Observation>& observations)
+		{
+			const auto currentThreadId = GetCurrentThreadId();
+			for (uint32_t attempt = 0; attempt < MAX_SUSPEND_ATTEMPTS; attempt++)
+			{
+				// Everything that allocates happens before suspending, as a suspended thread may hold the heap lock
+				std::vector<HANDLE> threads;
+				observations.clear();
+
+				const auto snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+				if (snapshot == INVALID_HANDLE_VALUE)
+					return false;
+
+				THREADENTRY32 entry{};
+				entry.dwSize = sizeof(entry);
+				for (BOOL found = Thread32First(snapshot, &entry); found; found = Thread32Next(snapshot, &entry))
+				{
+					if (entry.th32OwnerProcessID != GetCurrentProcessId() || entry.th32ThreadID == currentThreadId)
+						continue;
+
+					const auto thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE, entry.th32ThreadID);
+					if (thread == nullptr)
+						continue;
+
+					threads.push_back(thread);
+					observations.push_back({ entry.th32ThreadID, false, false, 0, 0, 0 });
+				}
+				CloseHandle(snapshot);
+
+				std::vector<char> isSuspended(threads.size(), 0);
+				for (size_t i = 0; i < threads.size(); i++)
+					isSuspended[i] = SuspendThread(threads[i]) != (DWORD)-1;
+
+				const bool isRegistering = state.pendingRegistrations.load() != 0;
+				if (!isRegistering)
+				{
+					for (size_t i = 0; i < threads.size(); i++)
+					{
+						// Threads that can't be suspended have exited
+						auto& observation = observations[i];
+						if (!isSuspended[i])
+						{
+							observation.isGone = true;
+							continue;
+						}
+
+						CONTEXT context{};
+						context.ContextFlags = CONTEXT_CONTROL;
+						if (!GetThreadContext(threads[i], &context))
+							continue;
+
+						const auto* record = FindRecord(state, observation.threadId);
+						observation.isKnown = true;
+						observation.nesting = record != nullptr ? record->nesting : 0;
+						observation.generation = record != nullptr ? record->generation : 0;
+						observation.eip = context.Eip;
+					}
+				}
+
+				for (size_t i = 0; i < threads.size(); i++)
+				{
+					if (isSuspended[i])
+						ResumeThread(threads[i]);
+					CloseHandle(threads[i]);
+				}
+
+				// A thread without a record could be anywhere in its first hook call, so try again once it has one
+				if (!isRegistering)
+				{
+					// Collecting from inside a hook call, e.g. a hook destroying itself
+					const auto* record = (const ThreadRecord*)TlsGetValue(state.tlsIndex);
+					observations.push_back({ currentThreadId, false, true, record != nullptr ? record->nesting : 0, record != nullptr ? record->generation : 0, 0 });
+					return true;
+				}
+
+				lock.unlock();
+				Sleep(0);
+				lock.lock();
+			}
+			return false;
+		}
+
+		// A thread stops holding a block once it is seen outside of every hook call, the block's code and the guarded ranges,
+		// once the outermost hook call it was seen in has finished, or once it exited. Threads that didn't hold the block
+		// when it was first checked can't reach it anymore. Blocks stay as they were if the threads can't be observed.
+		static void CheckBlocks(State& state, std::unique_lock<std::mutex>& lock)
+		{
+			std::vector<Observation> observations;
+			if (!Observe(state, lock, observations))
+				return;
+
+			for (auto& block : state.retiredBlocks)
+			{
+				std::vector<Wait> waits;
+				for (const auto& observation : observations)
+				{
+					if (observation.isGone)
+						continue;
+
+					const auto previous = std::find_if(block.waits.begin(), block.waits.end(), [&](const Wait& wait) { return wait.threadId == observation.threadId; });
+					if (block.isChecked && previous == block.waits.end())
+						continue;
+
+					if (observation.isKnown && observation.nesting == 0 && !IsInAny(observation.eip, block.ranges) && !IsInAny(observation.eip, state.guardedRanges))
+						continue;
+
+					const bool wasCounted = previous != block.waits.end() && previous->isCounted;
+					if (wasCounted && observation.isKnown && observation.generation != previous->generation)
+						continue;
+
+					waits.push_back(wasCounted ? *previous : Wait{ observation.threadId, observation.generation, observation.isKnown && observation.nesting != 0 });
+				}
+
+				block.waits = std::move(waits);
+				block.isChecked = true;
+			}
+		}
+	};
+
+	// The part of a hook's context the shared wrapper reads. Entry stubs push a pointer to it before jumping into the wrapper.
+	struct HookWrapperContext
+	{
+		// The wrapper calls through this slot, so it can be swapped while the hook is installed
+		std::atomic<uintptr_t> userHookFunctionAddress;
+		uintptr_t isCapturingAddress;
+		ArgumentRecorder* recorder;
+	};
+
+	// Generated code adapting a native function layout to a cdecl user hook. It only depends on the layout,
+	// so a single copy is shared by every hook with the same one; the hook itself is identified by its context.
+	class HookWrapper
+	{
+	public:
+		static uintptr_t GetShared(const std::vector<Location>& argumentLocations, const Location returnValueLocation, const bool userHookReturnsFloat)
+		{
+			std::string key;
+			for (const Location location : argumentLocations)
+			{
+				key.push_back((char)location);
+			}
+			key.push_back((char)returnValueLocation);
+			key.push_back(userHookReturnsFloat ? 1 : 0);
+
+			static std::mutex mutex;
+			static auto* wrappers = new std::unordered_map<std::string, uintptr_t>();
+
+			std::lock_guard lock(mutex);
+			auto wrapper = wrappers->find(key);
+			if (wrapper == wrappers->end())
+			{
+				wrapper = wrappers->emplace(key, Generate(argumentLocations, returnValueLocation, userHookReturnsFloat)).first;
+			}
+			return wrapper->second;
+		}
+
+	private:
+		static constexpr uint32_t MAX_HOOK_WRAPPER_CODE_SIZE = 512;
+
+		// mov eax, [esp + displacement]
+		static void AppendLoadFromStack(std::vector<uint8_t>& bytes, const uint32_t displacement)
+		{
+			bytes.push_back(0x8B);
+			if (displacement <= 0x7F)
+			{
+				bytes.push_back(0x44);
+				bytes.push_back(0x24);
+				bytes.push_back((uint8_t)displacement);
+			}
+			else
+			{
+				bytes.push_back(0x84);
+				bytes.push_back(0x24);
+				Utils::AppendUInt32(bytes, displacement);
+			}
+		}
+
+		// On entry the stack holds the context pushed by the entry stub, then the return address, then the stack arguments.
+		// The wrapper only addresses the stack and the context, so it is reentrant and safe to run on several threads at once.
+		static uintptr_t Generate(const std::vector<Location>& argumentLocations, const Location nativeReturnValueLocation, const bool userHookReturnsFloat)
+		{
+			const auto hookWrapperAddress = ExecutableMemory::Allocate(MAX_HOOK_WRAPPER_CODE_SIZE);
+
+			std::vector<uint8_t> hookWrapperBytes;
+
+			// Push all registers
+			hookWrapperBytes.push_back(0x60);
+
+			// Count the call in this thread's record, so the hook's code and context outlive it
+			Reclaimer::AppendEnter(hookWrapperBytes, hookWrapperAddress);
+
+			// Write a push for each argument, last one first. Stack arguments are read from
+			// [esp + 32 (pushad) + 4 (context) + 4 (return address) + 4 * index + 4 * pushed so far]
+			uint32_t stackArgumentIndex = (uint32_t)std::count(argumentLocations.begin(), argumentLocations.end(), Location::Stack);
+			uint32_t pushedArgumentCount = 0;
+			for (auto location = argumentLocations.rbegin(); location != argumentLocations.rend(); ++location)
+			{
+				switch (*location)
+				{
+				case Location::Stack:
+				{
+					const uint32_t displacement = 40 + 4 * --stackArgumentIndex + 4 * pushedArgumentCount;
+					hookWrapperBytes.push_back(0xFF);
+					if (displacement <= 0x7F)
+					{
+						hookWrapperBytes.push_back(0x74);
+						hookWrapperBytes.push_back(0x24);
+						hookWrapperBytes.push_back((uint8_t)displacement);
+					}
+					else
+					{
+						hookWrapperBytes.push_back(0xB4);
+						hookWrapperBytes.push_back(0x24);
+						Utils::AppendUInt32(hookWrapperBytes, displacement);
+					}
+				}
+					break;
+				case Location::EAX:
+					hookWrapperBytes.push_back(0x50);
+					break;
+				case Location::EBX:
+					hookWrapperBytes.push_back(0x53);
+					break;
+				case Location::ECX:
+					hookWrapperBytes.push_back(0x51);
+					break;
+				case Location::EDX:
+					hookWrapperBytes.push_back(0x52);
+					break;
+				case Location::ESI:
+					hookWrapperBytes.push_back(0x56);
+					break;
+				case Location::EDI:
+					hookWrapperBytes.push_back(0x57);
+					break;
+				default:
+					throw std::exception("Not yet implemented");
+				}
+				pushedArgumentCount++;
+			}
+
+			// All registers are saved and the arguments pushed, so eax, ecx and edx are free from here on
+			const uint32_t contextDisplacement = 32 + 4 * pushedArgumentCount;
+			AppendLoadFromStack(hookWrapperBytes, contextDisplacement);
+
+			// If capturing, hand the arguments we just pushed to the recorder
+			{
+				// mov ecx, [eax + isCapturingAddress]; cmp byte ptr [ecx], 0
+				hookWrapperBytes.push_back(0x8B);
+				hookWrapperBytes.push_back(0x48);
+				hookWrapperBytes.push_back((uint8_t)offsetof(HookWrapperContext, isCapturingAddress));
+				hookWrapperBytes.push_back(0x80);
+				hookWrapperBytes.push_back(0x39);
+				hookWrapperBytes.push_back(0x00);
+
+				// je over the recording call
+				hookWrapperBytes.push_back(0x74);
+				const auto skipOffsetIndex = hookWrapperBytes.size();
+				hookWrapperBytes.push_back(0x00);
+
+				// mov ecx, esp; push ecx; push dword ptr [eax + recorder]
+				hookWrapperBytes.push_back(0x89);
+				hookWrapperBytes.push_back(0xE1);
+				hookWrapperBytes.push_back(0x51);
+				hookWrapperBytes.push_back(0xFF);
+				hookWrapperBytes.push_back(0x70);
+				hookWrapperBytes.push_back((uint8_t)offsetof(HookWrapperContext, recorder));
+
+				// call ArgumentRecorder::Record
+				Utils::AppendRelative(hookWrapperBytes, 0xE8, hookWrapperAddress, (uintptr_t)&ArgumentRecorder::Record);
+
+				// add esp, 8
+				hookWrapperBytes.push_back(0x83);
+				hookWrapperBytes.push_back(0xC4);
+				hookWrapperBytes.push_back(0x08);
+
+				// The call clobbered eax, so load the context again
+				AppendLoadFromStack(hookWrapperBytes, contextDisplacement);
+
+				hookWrapperBytes[skipOffsetIndex] = (uint8_t)(hookWrapperBytes.size() - skipOffsetIndex - 1);
+			}
+
+			// push argumentCount; push dword ptr [eax + userHookFunctionAddress]; call Reclaimer::CallUserHook; add esp, 8
+			hookWrapperBytes.push_back(0x68);
+			Utils::AppendUInt32(hookWrapperBytes, pushedArgumentCount);
+			hookWrapperBytes.push_back(0xFF);
+			hookWrapperBytes.push_back(0x70);
+			hookWrapperBytes.push_back((uint8_t)offsetof(HookWrapperContext, userHookFunctionAddress));
+			Utils::AppendRelative(hookWrapperBytes, 0xE8, hookWrapperAddress, (uintptr_t)&Reclaimer::CallUserHook);
+			hookWrapperBytes.insert(hookWrapperBytes.end(), { 0x83, 0xC4, 0x08 });
+
+			// add esp, X
+			if (pushedArgumentCount > 0)
+			{
+				hookWrapperBytes.push_back(0x81);
+				hookWrapperBytes.push_back(0xC4);
+				Utils::AppendUInt32(hookWrapperBytes, pushedArgumentCount * 4);
+			}
+
+			// Put return value where it needs to go, by overwriting the register's slot of the pushad frame
+			// We sort of assume the user's hook function itself to be CDECL
+			auto returnValueLocation = userHookReturnsFloat ? Location::ST0 : Location::EAX;
+			if (returnValueLocation == Location::EAX)
+			{
+				uint8_t pushadSlotOffset;
+				switch (nativeReturnValueLocation)
+				{
+				case Location::EAX:
+					pushadSlotOffset = 28;
+					break;
+				case Location::ECX:
+					pushadSlotOffset = 24;
+					break;
+				case Location::EDX:
+					pushadSlotOffset = 20;
+					break;
+				case Location::EBX:
+					pushadSlotOffset = 16;
+					break;
+				case Location::ESI:
+					pushadSlotOffset = 4;
+					break;
+				case Location::EDI:
+					pushadSlotOffset = 0;
+					break;
+				// TODO: Handle 8-bit registers
+				default:
+					throw std::exception("Return value location not implemented");
+				}
+
+				// mov [esp + pushadSlotOffset], eax
+				hookWrapperBytes.push_back(0x89);
+				hookWrapperBytes.push_back(0x44);
+				hookWrapperBytes.push_back(0x24);
+				hookWrapperBytes.push_back(pushadSlotOffset);
+			}
+			else if (returnValueLocation == Location::ST0)
+			{
+				switch (nativeReturnValueLocation)
+				{
+				case Location::ST0:
+					break;
+				// TODO: Implement these on-demand
+				default:
+					throw std::exception("Floating-point return value location not implemented");
+				}
+			}
+			else
+			{
+				throw std::logic_error("Return value location for CDECL function was neither EAX nor ST0");
+			}
+
+			// The context isn't read past this point
+			Reclaimer::AppendLeave(hookWrapperBytes);
+
+			// Pop all registers
+			hookWrapperBytes.push_back(0x61);
+
+			// Drop the context: lea esp, [esp + 4]
+			hookWrapperBytes.insert(hookWrapperBytes.end(), { 0x8D, 0x64, 0x24, 0x04 });
+
+			// Write Return
+			hookWrapperBytes.push_back(0xC3);
+
+			// Write hook wrapper to memory
+			if (hookWrapperBytes.size() > MAX_HOOK_WRAPPER_CODE_SIZE)
+				throw std::logic_error("Hook Wrapper Function byte size was larger than MAX_HOOK_WRAPPER_CODE_SIZE");
+
+			std::memcpy((void*)hookWrapperAddress, hookWrapperBytes.data(), hookWrapperBytes.size());
+
+			SymbolMap::Register(hookWrapperAddress, hookWrapperBytes.size(),
+				"Unconventional::HookWrapper" + LocationUtils::DescribeLayout(argumentLocations, nativeReturnValueLocation) + (userHookReturnsFloat ? " float" : ""));
+			return hookWrapperAddress;
+		}
+	};
+
+	// Everything a Hook's generated code refers to. It lives out-of-line, so moving a Hook only moves a pointer
+	// and never invalidates the entry stub.
+	struct HookContext : HookWrapperContext
+	{
+		uintptr_t functionAddress;
+		uint8_t opCodeSize;
+		bool isInstalled;
+
+		uintptr_t trampolineAddress;
+		uintptr_t entryStubAddress;
+
+		ArgumentRecorder argumentRecorder;
+
+		// Bit in the Reclaimer's per-thread bitmap of disabled hooks
+		uint32_t hookId;
+
+		struct CallSite
+		{
+			uintptr_t address;
+			uint32_t originalDisplacement;
+		};
+
+		// Direct calls redirected to the entry stub by InstallAtCallSites
+		std::vector<CallSite> callSites;
+
+		HookContext(const uintptr_t functionAddress, const uintptr_t userHookFunctionAddress, const uint8_t opCodeSize, const uint32_t argumentCount)
+			: HookWrapperContext{ userHookFunctionAddress, 0, nullptr }, functionAddress(functionAddress), opCodeSize(opCodeSize), isInstalled(false),
+			  trampolineAddress(0), entryStubAddress(0), argumentRecorder(argumentCount), hookId(0)
+		{
+			static_assert(sizeof(std::atomic<uintptr_t>) == sizeof(uintptr_t) && std::atomic<uintptr_t>::is_always_lock_free, "The wrapper reads userHookFunctionAddress as a plain pointer");
+
+			if (opCodeSize < Utils::SIZE_OF_JUMP)
+			{
+				throw std::invalid_argument("At least 5 bytes are required for hooking");
+			}
+
+			hookId = Reclaimer::AllocateHookId();
+
+			isCapturingAddress = argumentRecorder.GetIsCapturingAddress();
+			recorder = &argumentRecorder;
+
+			trampolineAddress = Utils::CreateTrampoline(functionAddress, opCodeSize);
+		}
+
+		HookContext(const HookContext&) = delete;
+		HookContext& operator=(const HookContext&) = delete;
+
+		~HookContext()
+		{
+			Uninstall();
+
+			SymbolMap::Unregister(trampolineAddress);
+			ExecutableMemory::Free(trampolineAddress, opCodeSize + Utils::SIZE_OF_JUMP);
+			if (entryStubAddress != 0)
+			{
+				SymbolMap::Unregister(entryStubAddress);
+				ExecutableMemory::Free(entryStubAddress, MAX_ENTRY_STUB_CODE_SIZE);
+			}
+
+			Reclaimer::ReleaseHookId(hookId);
+		}
+
+		// The entry stub is all the code a hook owns: the bypass check, a push of this context and a jump into the shared wrapper
+		void CreateEntryStub(const uintptr_t sharedWrapperAddress, const std::string& layoutDescription)
+		{
+			entryStubAddress = ExecutableMemory::Allocate(MAX_ENTRY_STUB_CODE_SIZE);
+
+			std::vector<uint8_t> bytes;
+
+			// Threads that disabled the hook continue in the trampoline, with the stack untouched
+			Reclaimer::AppendDisabledCheck(bytes, entryStubAddress, hookId, trampolineAddress);
+
+			// push context
+			bytes.push_back(0x68);
+			Utils::AppendUInt32(bytes, (uintptr_t)static_cast<HookWrapperContext*>(this));
+
+			// jmp sharedWrapper
+			Utils::AppendRelative(bytes, 0xE9, entryStubAddress, sharedWrapperAddress);
+
+			std::memcpy((void*)entryStubAddress, bytes.data(), bytes.size());
+			SymbolMap::Register(entryStubAddress, bytes.size(), SymbolMap::MakeName("HookEntry", functionAddress, layoutDescription));
+		}
+
+		void Install()
+		{
+			if (!callSites.empty())
+			{
+				throw std::logic_error("Hook is already installed at call sites");
+			}
+
+			if (!isInstalled)
+			{
+				Utils::WriteJump(functionAddress, entryStubAddress);
+				isInstalled = true;
+			}
+		}
+
+		void Uninstall()
+		{
+			if (isInstalled)
+			{
+				std::memcpy((void*)functionAddress, (void*)trampolineAddress, opCodeSize);
+				isInstalled = false;
+			}
+
+			for (const auto& callSite : callSites)
+				WriteCallDisplacement(callSite.address, callSite.originalDisplacement);
+
+			callSites.clear();
+		}
+
+		size_t InstallAtCallSites(const std::vector<uintptr_t>& addresses)
+		{
+			if (isInstalled)
+			{
+				throw std::logic_error("Hook is already installed at the function's prologue");
+			}
+
+			// Nothing is written unless every site at least looks like a call to the function
+			for (const auto address : addresses)
+			{
+				if (*(const uint8_t*)address != 0xE8 || address + Utils::SIZE_OF_JUMP + *(const int32_t*)(address + 1) != functionAddress)
+					throw std::invalid_argument("Call site is not a direct call to the hooked function");
+			}
+
+			for (const auto address : addresses)
+			{
+				callSites.push_back({ address, *(uint32_t*)(address + 1) });
+				WriteCallDisplacement(address, entryStubAddress - address - Utils::SIZE_OF_JUMP);
+			}
+			return callSites.size();
+		}
+
+		// Swaps the rel32 of a call instruction, so a thread executing the call sees either the old or the new target
+		static void WriteCallDisplacement(const uintptr_t callSite, const uint32_t displacement)
+		{
+			std::vector<uint8_t> call;
+			call.push_back(0xE8);
+			Utils::AppendUInt32(call, displacement);
+			Utils::WritePatch(callSite, call.data());
+		}
+
+		// The hook's own code, which a thread may still be executing right after uninstalling
+		std::vector<Reclaimer::Range> GetCodeRanges() const
+		{
+			std::vector<Reclaimer::Range> ranges{ { trampolineAddress, (size_t)opCodeSize + Utils::SIZE_OF_JUMP } };
+			if (entryStubAddress != 0)
+				ranges.push_back({ entryStubAddress, MAX_ENTRY_STUB_CODE_SIZE });
+			return ranges;
+		}
+
+		// Where the original behavior can be called: the function itself is left intact when only its call sites are rewritten
+		uintptr_t GetOriginalAddress() const
+		{
+			return callSites.empty() ? trampolineAddress : functionAddress;
+		}
+
+		void SetEnabledOnCurrentThread(const bool enabled)
+		{
+			Reclaimer::SetHookDisabledOnCurrentThread(hookId, !enabled);
+		}
+
+		bool IsEnabledOnCurrentThread() const
+		{
+			return !Reclaimer::IsHookDisabledOnCurrentThread(hookId);
+		}
+
+		static constexpr uint32_t MAX_ENTRY_STUB_CODE_SIZE = 64;
+	};
+	
+	// Uninstalls a hook right away, but only destroys its context and frees its code once no thread is using them anymore
+	struct HookContextRetirer
+	{
+		template<typename Context>
+		void operator()(Context* context) const
+		{
+			context->Uninstall();
+			Reclaimer::Retire(context->GetCodeRanges(), [context]() { delete context; });
+		}
+	};
+
+	template<typename Signature, typename ReturnType, typename... ArgumentTypes>
+	class Hook
+	{
+	public:
+		void Install()
+		{
+			GetContext().Install();
+		}
+
+		// Instead of patching the prologue, rewrites the given direct calls (E8 rel32) to the function to call the hook.
+		// The function itself stays untouched, so CallOriginalFunction calls it directly. The sites have to be verified
+		// instruction boundaries: ModuleUtils::FindCallSites only yields candidates, which may lie inside other instructions
+		// or data. Calls through pointers are not redirected. Returns the number of rewritten call sites.
+		size_t InstallAtCallSites(const std::vector<uintptr_t>& callSites)
+		{
+			return GetContext().InstallAtCallSites(callSites);
+		}
+
+		// Restores the prologue and every rewritten call site
+		void Uninstall()
+		{
+			GetContext().Uninstall();
+		}
+
+		ReturnType CallOriginalFunction(ArgumentTypes... arguments)
+		{
+			auto& context = GetContext();
+			Function<Signature, ReturnType, ArgumentTypes...> originalFunction(context.GetOriginalAddress());
+
+			if constexpr (Signature::IsPure())
+			{
+				static_assert(sizeof(ReturnType) <= sizeof(uint32_t), "Memoized return values have to fit into 32 bits");
+
+				const typename MemoizationCacheType::Key key{ *(std::uint32_t*)&arguments... };
+
+				uint32_t cachedResult;
+				if (context.memoizationCache.TryGet(key, cachedResult))
+					return *(ReturnType*)&cachedResult;
+
+				const auto ticket = context.memoizationCache.GetTicket(key);
+				ReturnType result = originalFunction.Call(arguments...);
+
+				uint32_t resultWord = 0;
+				std::memcpy(&resultWord, &result, sizeof(ReturnType));
+				context.memoizationCache.Store(key, resultWord, ticket);
+
+				return result;
+			}
+			else
+			{
+				return originalFunction.Call(arguments...);
+			}
+		}
+
+		void InvalidateMemoizedResult(ArgumentTypes... arguments)
+		{
+			static_assert(Signature::IsPure(), "Only hooks of Pure signatures memoize results");
+
+			GetContext().memoizationCache.Invalidate({ *(std::uint32_t*)&arguments... });
+		}
+
+		void InvalidateMemoizedResults()
+		{
+			static_assert(Signature::IsPure(), "Only hooks of Pure signatures memoize results");
+
+			GetContext().memoizationCache.InvalidateAll();
+		}
+
+		MemoizationStatistics GetMemoizationStatistics() const
+		{
+			static_assert(Signature::IsPure(), "Only hooks of Pure signatures memoize results");
+
+			return GetContext().memoizationCache.GetStatistics();
+		}
+
+		// Records the arguments of every call (up to maxCalls) into a file that can be loaded as a Recording
+		void StartCapture(const std::string& path, const uint32_t maxCalls = 1 << 20)
+		{
+			GetContext().argumentRecorder.Start(path, maxCalls);
+		}
+
+		void StopCapture()
+		{
+			GetContext().argumentRecorder.Stop();
+		}
+
+		// Swaps the user hook function with a single atomic store. Calls already inside the old function finish normally.
+		void Retarget(const uintptr_t hookFunctionAddress)
+		{
+			GetContext().userHookFunctionAddress.store(hookFunctionAddress, std::memory_order_release);
+		}
+
+		// Lets the calling thread run the original function while the hook stays active for all other threads.
+		// This only writes a TLS slot, the hooked code is not touched.
+		void SetEnabledOnCurrentThread(const bool enabled)
+		{
+			GetContext().SetEnabledOnCurrentThread(enabled);
+		}
+
+		bool IsEnabledOnCurrentThread() const
+		{
+			return GetContext().IsEnabledOnCurrentThread();
+		}
+
+		Hook() = default;
+
+		Hook(Function<Signature, ReturnType, ArgumentTypes...> originalFunction, uintptr_t hookFunctionAddress, const uint8_t opCodeSize)
+			: context(new Context(originalFunction.GetAddress(), hookFunctionAddress, opCodeSize, (uint32_t)sizeof...(ArgumentTypes)))
+		{
+			const auto argumentLocations = Signature::GetArgumentLocations();
+			context->CreateEntryStub(GetSharedWrapper(), LocationUtils::DescribeLayout(std::vector<Location>(argumentLocations.begin(), argumentLocations.end()), Signature::GetReturnValueLocation()));
+		}
+
+		Hook(Hook&&) noexcept = default;
+		Hook& operator=(Hook&&) noexcept = default;
+
+		Hook(const Hook&) = delete;
+		Hook& operator=(const Hook&) = delete;
+
+	private:
+		using MemoizationCacheType = std::conditional_t<Signature::IsPure(), MemoizationCache<sizeof...(ArgumentTypes), Signature::GetMemoizationCacheSize()>, std::monostate>;
+
+		struct Context : HookContext
+		{
+			using HookContext::HookContext;
+
+			MemoizationCacheType memoizationCache;
+		};
+
+		std::unique_ptr<Context, HookContextRetirer> context;
+
+		Context& GetContext() const
+		{
+			if (!context)
+			{
+				throw std::logic_error("Hook was not initialized");
+			}
+
+			return *context;
+		}
+
+		static uintptr_t GetSharedWrapper()
+		{
+			static const uintptr_t sharedWrapperAddress = []()
+			{
+				const auto argumentLocations = Signature::GetArgumentLocations();
+				return HookWrapper::GetShared(std::vector<Location>(argumentLocations.begin(), argumentLocations.end()), Signature::GetReturnValueLocation(), std::is_floating_point<ReturnType>());
+			}();
+			return sharedWrapperAddress;
+		}
+		
+	};
+
+	// Hook of a function with a RuntimeSignature, running through the same shared wrappers as Hook. The user hook is a cdecl
+	// function taking one 32-bit word per argument and returning a word, or a float if the signature returns one in ST0.
+	class DynamicHook
+	{
+	public:
+		DynamicHook() = default;
+
+		DynamicHook(const uintptr_t functionAddress, const RuntimeSignature& signature, const uintptr_t hookFunctionAddress, const uint8_t opCodeSize)
+			: context(new HookContext(functionAddress, hookFunctionAddress, opCodeSize, (uint32_t)signature.GetArgumentLocations().size())),
+			  callStub(CallStub::GetShared(signature)), argumentCount((uint32_t)signature.GetArgumentLocations().size())
+		{
+			const auto sharedWrapperAddress = HookWrapper::GetShared(signature.GetArgumentLocations(), signature.GetReturnValueLocation(), signature.ReturnsFloat());
+			context->CreateEntryStub(sharedWrapperAddress, signature.Describe());
+		}
+
+		DynamicHook(DynamicHook&&) noexcept = default;
+		DynamicHook& operator=(DynamicHook&&) noexcept = default;
+
+		DynamicHook(const DynamicHook&) = delete;
+		DynamicHook& operator=(const DynamicHook&) = delete;
+
+		void Install()
+		{
+			GetContext().Install();
+		}
+
+		size_t InstallAtCallSites(const std::vector<uintptr_t>& callSites)
+		{
+			return GetContext().InstallAtCallSites(callSites);
+		}
+
+		void Uninstall()
+		{
+			GetContext().Uninstall();
+		}
+
+		template<typename ReturnType = uint32_t>
+		ReturnType CallOriginalFunction(const std::vector<uint32_t>& arguments) const
+		{
+			static_assert(sizeof(ReturnType) <= sizeof(uint32_t), "Return values have to fit into 32 bits");
+
+			if (arguments.size() != argumentCount)
+				throw std::invalid_argument("Amount of arguments does not match the signature");
+
+			const uint32_t returnValue = callStub(arguments.data(), GetContext().GetOriginalAddress());
+			return *(ReturnType*)&returnValue;
+		}
+
+		void StartCapture(const std::string& path, const uint32_t maxCalls = 1 << 20)
+		{
+			GetContext().argumentRecorder.Start(path, maxCalls);
+		}
+
+		void StopCapture()
+		{
+			GetContext().argumentRecorder.Stop();
+		}
+
+		void Retarget(const uintptr_t hookFunctionAddress)
+		{
+			GetContext().userHookFunctionAddress.store(hookFunctionAddress, std::memory_order_release);
+		}
+
+		void SetEnabledOnCurrentThread(const bool enabled)
+		{
+			GetContext().SetEnabledOnCurrentThread(enabled);
+		}
+
+		bool IsEnabledOnCurrentThread() const
+		{
+			return GetContext().IsEnabledOnCurrentThread();
+		}
+
+	private:
+		std::unique_ptr<HookContext, HookContextRetirer> context;
+		CallStub::Type callStub = nullptr;
+		uint32_t argumentCount = 0;
+
+		HookContext& GetContext() const
+		{
+			if (!context)
+			{
+				throw std::logic_error("Hook was not initialized");
+			}
+
+			return *context;
+		}
+	};
+
+	// The reverse of Function: exposes a cdecl C++ function as a native function with the given signature, e.g. to pass it as a
+	// callback to code expecting a __usercall. A __usercall caller may expect any register to survive that is neither an argument
+	// nor the return location, so the thunk saves whichever of eax, ecx and edx that applies to; the C++ function preserves
+	// ebx, esi, edi and ebp itself. Native code must not call the thunk anymore once the Callback is destroyed.
+	template<typename Signature, typename ReturnType, typename... ArgumentTypes>
+	class Callback
+	{
+	public:
+		using CallbackFunction = ReturnType(__cdecl*)(ArgumentTypes...);
+
+		Callback() = default;
+
+		Callback(CallbackFunction function)
+		{
+			static_assert(Signature::GetArgumentLocations().size() == sizeof...(ArgumentTypes), "Amount of argument locations does not match number of function arguments");
+			static_assert(!Signature::HasArgumentInRegister(Location::ST0), "Arguments in FPU registers are currently not supported");
+			static_assert((Signature::GetReturnValueLocation() == Location::ST0) == std::is_floating_point<ReturnType>(), "Floating-point return values have to be in ST0");
+
+			thunkAddress = ExecutableMemory::Allocate(MAX_THUNK_CODE_SIZE);
+
+			std::vector<uint8_t> bytes;
+
+			// push reg, for each of the registers the cdecl call may clobber that the caller doesn't expect to change
+			constexpr auto argumentLocations = Signature::GetArgumentLocations();
+			constexpr Location returnValueLocation = Signature::GetReturnValueLocation();
+			std::vector<Location> savedRegisters;
+			for (const auto location : { Location::EAX, Location::ECX, Location::EDX })
+			{
+				if (location != returnValueLocation && std::find(argumentLocations.begin(), argumentLocations.end(), location) == argumentLocations.end())
+				{
+					bytes.push_back(0x50 + LocationUtils::GetRegisterNumber(location));
+					savedRegisters.push_back(location);
+				}
+			}
+
+			// Push each argument, last one first. Stack arguments are read from [esp + 4 (return address) + 4 * saved + 4 * index + 4 * pushed so far]
+			uint32_t stackArgumentIndex = Signature::GetStackArgumentCount();
+			uint32_t pushedArgumentCount = 0;
+			for (auto location = argumentLocations.rbegin(); location != argumentLocations.rend(); ++location)
+			{
+				if (*location == Location::Stack)
+				{
+					const uint32_t displacement = 4 + 4 * (uint32_t)savedRegisters.size() + 4 * --stackArgumentIndex + 4 * pushedArgumentCount;
+					bytes.push_back(0xFF);
+					if (displacement <= 0x7F)
+					{
+						bytes.insert(bytes.end(), { 0x74, 0x24 });
+						bytes.push_back((uint8_t)displacement);
+					}
+					else
+					{
+						bytes.insert(bytes.end(), { 0xB4, 0x24 });
+						Utils::AppendUInt32(bytes, displacement);
+					}
+				}
+				else
+				{
+					// push reg
+					bytes.push_back(0x50 + LocationUtils::GetRegisterNumber(*location));
+				}
+				pushedArgumentCount++;
+			}
+
+			// call function
+			Utils::AppendRelative(bytes, 0xE8, thunkAddress, (uintptr_t)function);
+
+			// add esp, X
+			if (pushedArgumentCount > 0)
+			{
+				bytes.insert(bytes.end(), { 0x81, 0xC4 });
+				Utils::AppendUInt32(bytes, pushedArgumentCount * 4);
+			}
+
+			// mov reg, eax
+			if constexpr (returnValueLocation != Location::EAX && returnValueLocation != Location::ST0)
+			{
+				bytes.push_back(0x89);
+				bytes.push_back(0xC0 + LocationUtils::GetRegisterNumber(returnValueLocation));
+			}
+
+			// pop reg, in reverse
+			for (auto location = savedRegisters.rbegin(); location != savedRegisters.rend(); ++location)
+				bytes.push_back(0x58 + LocationUtils::GetRegisterNumber(*location));
+
+			// ret
+			bytes.push_back(0xC3);
+
+			if (bytes.size() > MAX_THUNK_CODE_SIZE)
+			{
+				ExecutableMemory::Free(thunkAddress, MAX_THUNK_CODE_SIZE);
+				throw std::logic_error("Callback thunk byte size was larger than MAX_THUNK_CODE_SIZE");
+			}
+
+			std::memcpy((void*)thunkAddress, bytes.data(), bytes.size());
+			SymbolMap::Register(thunkAddress, bytes.size(), SymbolMap::MakeName("Callback", (uintptr_t)function));
+		}
+
+		Callback(Callback&& other) noexcept : thunkAddress(std::exchange(other.thunkAddress, 0))
+		{
+		}
+
+		Callback& operator=(Callback&& other) noexcept
+		{
+			std::swap(thunkAddress, other.thunkAddress);
+			return *this;
+		}
+
+		Callback(const Callback&) = delete;
+		Callback& operator=(const Callback&) = delete;
+
+		~Callback()
+		{
+			if (thunkAddress != 0)
+			{
+				SymbolMap::Unregister(thunkAddress);
+				ExecutableMemory::Free(thunkAddress, MAX_THUNK_CODE_SIZE);
+			}
+		}
+
+		// The native function pointer
+		uintptr_t GetAddress() const { return thunkAddress; }
+
+		Function<Signature, ReturnType, ArgumentTypes...> AsFunction() const
+		{
+			return Function<Signature, ReturnType, ArgumentTypes...>(thunkAddress);
+		}
+
+	private:
+		static constexpr uint32_t MAX_THUNK_CODE_SIZE = 256;
+
+		uintptr_t thunkAddress = 0;
+	};
+
+	struct ProbeEvent
+	{
+		uintptr_t functionAddress;
+		// Function of the probed frame below this one on the same thread, or 0
+		uintptr_t parentFunctionAddress;
+		uintptr_t returnAddress;
+		uint32_t depth;
+		uint64_t timestamp;
+		// Only set for exit events
+		uint64_t elapsed;
+		// The frame was left without returning through the exit stub, e.g. by an exception or longjmp
+		bool isUnwound;
+	};
+
+	using ProbeHandler = void(*)(const ProbeEvent& event, void* userData);
+
+	// Keeps track of the probed frames of each thread. Probe entry stubs replace the return address of a call
+	// with the probe's exit stub and push the real one here, so enter and exit can be observed without a user frame.
+	class ShadowStack
+	{
+	public:
+		struct ProbeContext
+		{
+			uintptr_t functionAddress;
+			ProbeHandler onEnter;
+			ProbeHandler onExit;
+			void* userData;
+			uintptr_t exitStubAddress;
+		};
+
+		static void __cdecl OnEnter(const ProbeContext* probe, const uintptr_t returnSlot)
+		{
+			auto& frames = GetFrames();
+
+			// A tail call out of a probed function reuses its return slot, which still holds that function's exit stub.
+			// The caller is done at this point, so the new frame takes over its real return address.
+			auto returnAddress = *(uintptr_t*)returnSlot;
+			if (!frames.empty() && frames.back().returnSlot == returnSlot && returnAddress == frames.back().probe->exitStubAddress)
+			{
+				returnAddress = frames.back().returnAddress;
+				Pop(frames, false);
+			}
+
+			// Frames at or below the new return slot can not be alive anymore, their exit stubs were skipped
+			while (!frames.empty() && frames.back().returnSlot <= returnSlot)
+			{
+				Pop(frames, true);
+			}
+
+			const auto timestamp = __rdtsc();
+			frames.push_back({ probe, returnAddress, returnSlot, timestamp });
+
+			if (probe->onEnter != nullptr)
+			{
+				const ProbeEvent event{ probe->functionAddress, GetParentFunctionAddress(frames), returnAddress, (uint32_t)frames.size() - 1, timestamp, 0, false };
+				probe->onEnter(event, probe->userData);
+			}
+		}
+
+		// Returns the real return address for the frame whose return slot was at returnSlot
+		static uintptr_t __cdecl OnExit(const uintptr_t returnSlot)
+		{
+			auto& frames = GetFrames();
+
+			while (!frames.empty() && frames.back().returnSlot < returnSlot)
+			{
+				Pop(frames, true);
+			}
+
+			// Without a matching frame there is no way to know where to return to
+			if (frames.empty() || frames.back().returnSlot != returnSlot)
+				std::terminate();
+
+			const auto frame = frames.back();
+			const auto timestamp = __rdtsc();
+			const ProbeEvent event{ frame.probe->functionAddress, GetParentFunctionAddress(frames), frame.returnAddress, (uint32_t)frames.size() - 1, timestamp, timestamp - frame.timestamp, false };
+			frames.pop_back();
+
+			if (frame.probe->onExit != nullptr)
+			{
+				frame.probe->onExit(event, frame.probe->userData);
+			}
+
+			return frame.returnAddress;
+		}
+
+	private:
+		struct Frame
+		{
+			const ProbeContext* probe;
+			uintptr_t returnAddress;
+			uintptr_t returnSlot;
+			uint64_t timestamp;
+		};
+
+		static std::vector<Frame>& GetFrames()
+		{
+			thread_local std::vector<Frame> frames;
+			return frames;
+		}
+
+		static uintptr_t GetParentFunctionAddress(const std::vector<Frame>& frames)
+		{
+			return frames.size() > 1 ? frames[frames.size() - 2].probe->functionAddress : 0;
+		}
+
+		static void Pop(std::vector<Frame>& frames, const bool isUnwound)
+		{
+			const auto frame = frames.back();
+			if (frame.probe->onExit != nullptr)
+			{
+				const auto timestamp = __rdtsc();
+				const ProbeEvent event{ frame.probe->functionAddress, GetParentFunctionAddress(frames), frame.returnAddress, (uint32_t)frames.size() - 1, timestamp, timestamp - frame.timestamp, isUnwound };
+				frame.probe->onExit(event, frame.probe->userData);
+			}
+			frames.pop_back();
+		}
+	};
+
+	// Entry and exit instrumentation without a user hook frame. The exit is observed by redirecting
+	// the return address to an exit stub, so this only supports caller cleanup conventions.
+	// The probe must outlive every call that entered it, as those still return through its exit stub.
+	template<typename Signature, typename ReturnType, typename... ArgumentTypes>
+	class Probe
+	{
+	public:
+		void Install()
+		{
+			if (!isInitialized)
+			{
+				throw std::logic_error("Probe was not initialized");
+			}
+
+			if (!isInstalled)
+			{
+				Utils::WriteJump(context->functionAddress, entryStubAddress);
+				isInstalled = true;
+			}
+		}
+
+		void Uninstall()
+		{
+			if (!isInitialized)
+			{
+				throw std::logic_error("Probe was not initialized");
+			}
+
+			if (isInstalled)
+			{
+				// Only the first five bytes were replaced by the jump, and other threads may be running through them
+				Utils::WritePatch(context->functionAddress, (const uint8_t*)trampolineAddress);
+				isInstalled = false;
+			}
+		}
+
+		Probe(Function<Signature, ReturnType, ArgumentTypes...> function, const uint8_t opCodeSize, ProbeHandler onEnter, ProbeHandler onExit, void* userData = nullptr)
+			: isInitialized(false), isInstalled(false), opCodeSize(opCodeSize), context(new ShadowStack::ProbeContext{ function.GetAddress(), onEnter, onExit, userData, 0 }),
+			  trampolineAddress(0), entryStubAddress(0), exitStubAddress(0)
+		{
+			static_assert(CallingConventionUtils::SpecifiesCallerCleanup(Signature::GetCallingConvention()), "Probes require caller cleanup");
+
+			if (opCodeSize < Utils::SIZE_OF_JUMP)
+			{
+				throw std::invalid_argument("At least 5 bytes are required for hooking");
+			}
+
+			trampolineAddress = Utils::CreateTrampoline(context->functionAddress, opCodeSize);
+			SetupExitStub();
+			SetupEntryStub();
+
+			isInitialized = true;
+		}
+
+		Probe(const Probe&) = delete;
+		Probe& operator=(const Probe&) = delete;
+
+		~Probe()
+		{
+			if (isInitialized)
+			{
+				Uninstall();
+
+				for (const auto address : { trampolineAddress, entryStubAddress, exitStubAddress })
+					SymbolMap::Unregister(address);
+
+				ExecutableMemory::Free(trampolineAddress, opCodeSize + Utils::SIZE_OF_JUMP);
+				ExecutableMemory::Free(entryStubAddress, MAX_STUB_CODE_SIZE);
+				ExecutableMemory::Free(exitStubAddress, MAX_STUB_CODE_SIZE);
+			}
+		}
+
+	private:
+		bool isInitialized;
+		bool isInstalled;
+
+		uint8_t opCodeSize;
+		std::unique_ptr<ShadowStack::ProbeContext> context;
+
+		uintptr_t trampolineAddress;
+		uintptr_t entryStubAddress;
+		uintptr_t exitStubAddress;
+
+		static constexpr uint32_t MAX_STUB_CODE_SIZE = 64;
+
+		void SetupEntryStub()
+		{
+			entryStubAddress = ExecutableMemory::Allocate(MAX_STUB_CODE_SIZE);
+
+			std::vector<uint8_t> bytes;
+
+			// pushad
+			bytes.push_back(0x60);
+
+			// lea eax, [esp + 32] (the return address slot) and push it, followed by the context
+			bytes.insert(bytes.end(), { 0x8D, 0x44, 0x24, 0x20 });
+			bytes.push_back(0x50);
+			bytes.push_back(0x68);
+			Utils::AppendUInt32(bytes, (uintptr_t)context.get());
+
+			// call ShadowStack::OnEnter
+			Utils::AppendRelative(bytes, 0xE8, entryStubAddress, (uintptr_t)&ShadowStack::OnEnter);
+
+			// add esp, 8
+			bytes.insert(bytes.end(), { 0x83, 0xC4, 0x08 });
+
+			// popad
+			bytes.push_back(0x61);
+
+			// mov dword ptr [esp], exitStubAddress
+			bytes.insert(bytes.end(), { 0xC7, 0x04, 0x24 });
+			Utils::AppendUInt32(bytes, exitStubAddress);
+
+			// jmp trampoline
+			Utils::AppendRelative(bytes, 0xE9, entryStubAddress, trampolineAddress);
+
+			std::memcpy((void*)entryStubAddress, bytes.data(), bytes.size());
+			SymbolMap::Register(entryStubAddress, bytes.size(), SymbolMap::MakeName("ProbeEntry", context->functionAddress));
+		}
+
+		void SetupExitStub()
+		{
+			exitStubAddress = ExecutableMemory::Allocate(MAX_STUB_CODE_SIZE);
+			context->exitStubAddress = exitStubAddress;
+
+			std::vector<uint8_t> bytes;
+
+			// push eax, reserving the slot the real return address goes into. It is the same slot the call originally used.
+			bytes.push_back(0x50);
+
+			// pushad
+			bytes.push_back(0x60);
+
+			// The x87 stack has to be empty when calling into C++, so a return value in ST0 is saved around the call
+			constexpr bool savesST0 = Signature::GetReturnValueLocation() == Location::ST0;
+			constexpr uint8_t returnSlotOffset = savesST0 ? 40 : 32;
+			if constexpr (savesST0)
+			{
+				// sub esp, 8; fstp qword ptr [esp]
+				bytes.insert(bytes.end(), { 0x83, 0xEC, 0x08 });
+				bytes.insert(bytes.end(), { 0xDD, 0x1C, 0x24 });
+			}
+
+			// lea eax, [esp + returnSlotOffset]; push eax
+			bytes.insert(bytes.end(), { 0x8D, 0x44, 0x24, returnSlotOffset });
+			bytes.push_back(0x50);
+
+			// call ShadowStack::OnExit
+			Utils::AppendRelative(bytes, 0xE8, exitStubAddress, (uintptr_t)&ShadowStack::OnExit);
+
+			// add esp, 4
+			bytes.insert(bytes.end(), { 0x83, 0xC4, 0x04 });
+
+			// mov [esp + returnSlotOffset], eax
+			bytes.insert(bytes.end(), { 0x89, 0x44, 0x24, returnSlotOffset });
+
+			if constexpr (savesST0)
+			{
+				// fld qword ptr [esp]; add esp, 8
+				bytes.insert(bytes.end(), { 0xDD, 0x04, 0x24 });
+				bytes.insert(bytes.end(), { 0x83, 0xC4, 0x08 });
+			}
+
+			// popad
+			bytes.push_back(0x61);
+
+			// ret
+			bytes.push_back(0xC3);
+
+			std::memcpy((void*)exitStubAddress, bytes.data(), bytes.size());
+			SymbolMap::Register(exitStubAddress, bytes.size(), SymbolMap::MakeName("ProbeExit", context->functionAddress));
+		}
+	};
+
+	struct CoverageHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t probeCount;
+	};
+
+	// One-shot probes for finding out which of many functions run at all. Each probe is a jmp over the first five bytes of a
+	// function into a stub that records the hit and puts the original bytes back, so every later call runs the untouched function.
+	// Probes are identified by their index in the list they were created from.
+	class CoverageProbes
+	{
+	public:
+		CoverageProbes(const std::vector<uintptr_t>& functionAddresses) : data(new Data(functionAddresses))
+		{
+		}
+
+		CoverageProbes(CoverageProbes&&) noexcept = default;
+		CoverageProbes& operator=(CoverageProbes&&) noexcept = default;
+
+		CoverageProbes(const CoverageProbes&) = delete;
+		CoverageProbes& operator=(const CoverageProbes&) = delete;
+
+		// Arms every probe that wasn't hit yet
+		void Install()
+		{
+			for (size_t i = 0; i < data->probeCount; i++)
+			{
+				auto& probe = data->probes[i];
+				if (WasHit(i) || probe.state.load(std::memory_order_acquire) != DISARMED)
+					continue;
+
+				std::vector<uint8_t> jump;
+				Utils::AppendRelative(jump, 0xE9, probe.functionAddress, data->stubsAddress + STUB_SIZE * i);
+
+				// Only armed once the jump is in place, so a Disarm in between waits for it instead of restoring first
+				uint32_t expected = DISARMED;
+				if (!probe.state.compare_exchange_strong(expected, RESTORING, std::memory_order_acq_rel))
+					continue;
+
+				Utils::WritePatch(probe.functionAddress, jump.data());
+				probe.state.store(ARMED, std::memory_order_release);
+			}
+		}
+
+		// Puts back the original bytes of every probe that wasn't hit
+		void Uninstall()
+		{
+			for (size_t i = 0; i < data->probeCount; i++)
+				Disarm(&data->probes[i]);
+		}
+
+		size_t GetProbeCount() const { return data->probeCount; }
+
+		bool WasHit(const size_t index) const
+		{
+			return (data->hitWords[index / 32].load(std::memory_order_relaxed) & (1u << (index % 32))) != 0;
+		}
+
+		size_t GetHitCount() const
+		{
+			size_t count = 0;
+			for (size_t i = 0; i < data->probeCount; i++)
+				count += WasHit(i) ? 1 : 0;
+			return count;
+		}
+
+		// Writes a CoverageHeader followed by one bit per probe
+		void Save(const std::string& path) const
+		{
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+			if (!file)
+				throw std::runtime_error("Could not open coverage file " + path);
+
+			const CoverageHeader header{ MAGIC, VERSION, (uint32_t)data->probeCount };
+			file.write((const char*)&header, sizeof(header));
+			for (size_t i = 0; i < GetHitWordCount(data->probeCount); i++)
+			{
+				const uint32_t word = data->hitWords[i].load(std::memory_order_relaxed);
+				file.write((const char*)&word, sizeof(word));
+			}
+
+			if (!file)
+				throw std::runtime_error("Could not write coverage file " + path);
+		}
+
+		static std::vector<bool> Load(const std::string& path)
+		{
+			std::ifstream file(path, std::ios::binary);
+			CoverageHeader header{};
+			if (!file.read((char*)&header, sizeof(header)) || header.magic != MAGIC || header.version != VERSION)
+				throw std::runtime_error("Not a coverage file: " + path);
+
+			// The count comes from the file, so check it against the file's length before allocating for it
+			const auto wordCount = GetHitWordCount(header.probeCount);
+			file.seekg(0, std::ios::end);
+			const auto fileSize = (uint64_t)file.tellg();
+			if (!file || fileSize < sizeof(header) + (uint64_t)wordCount * sizeof(uint32_t))
+				throw std::runtime_error("Coverage file is truncated: " + path);
+			file.seekg(sizeof(header));
+
+			std::vector<uint32_t> words(wordCount);
+			if (!file.read((char*)words.data(), words.size() * sizeof(uint32_t)))
+				throw std::runtime_error("Coverage file is truncated: " + path);
+
+			std::vector<bool> hits(header.probeCount);
+			for (size_t i = 0; i < header.probeCount; i++)
+				hits[i] = (words[i / 32] & (1u << (i % 32))) != 0;
+			return hits;
+		}
+
+	private:
+		static constexpr uint32_t MAGIC = 0x56434355;
+		static constexpr uint32_t VERSION = 1;
+
+		// push probe; jmp handler
+		static constexpr size_t STUB_SIZE = 16;
+
+		// RESTORING is held while either the jump or the original bytes are being written
+		enum ProbeState : uint32_t
+		{
+			DISARMED,
+			ARMED,
+			RESTORING
+		};
+
+		struct ProbeRecord
+		{
+			uintptr_t functionAddress;
+			std::array<uint8_t, Utils::SIZE_OF_JUMP> originalBytes;
+			std::atomic<uint32_t> state;
+			std::atomic<uint32_t>* hitWord;
+			uint32_t hitMask;
+		};
+
+		// Referenced by the stubs, so it lives out-of-line and is retired rather than destroyed
+		struct Data
+		{
+			size_t probeCount;
+			std::unique_ptr<ProbeRecord[]> probes;
+			std::unique_ptr<std::atomic<uint32_t>[]> hitWords;
+			uintptr_t stubsAddress;
+
+			Data(const std::vector<uintptr_t>& functionAddresses)
+				: probeCount(functionAddresses.size()), probes(new ProbeRecord[functionAddresses.size()]),
+				  hitWords(new std::atomic<uint32_t>[GetHitWordCount(functionAddresses.size())]), stubsAddress(0)
+			{
+				for (size_t i = 0; i < GetHitWordCount(probeCount); i++)
+					hitWords[i].store(0, std::memory_order_relaxed);
+
+				stubsAddress = ExecutableMemory::Allocate(GetStubsSize());
+				const auto handlerAddress = GetHandler();
+
+				for (size_t i = 0; i < probeCount; i++)
+				{
+					auto& probe = probes[i];
+					probe.functionAddress = functionAddresses[i];
+					std::memcpy(probe.originalBytes.data(), (const void*)probe.functionAddress, probe.originalBytes.size());
+					probe.state.store(DISARMED, std::memory_order_relaxed);
+					probe.hitWord = &hitWords[i / 32];
+					probe.hitMask = 1u << (i % 32);
+
+					const auto stubAddress = stubsAddress + STUB_SIZE * i;
+					std::vector<uint8_t> bytes;
+					bytes.push_back(0x68);
+					Utils::AppendUInt32(bytes, (uintptr_t)&probe);
+					Utils::AppendRelative(bytes, 0xE9, stubAddress, handlerAddress);
+					std::memcpy((void*)stubAddress, bytes.data(), bytes.size());
+				}
+
+				SymbolMap::Register(stubsAddress, GetStubsSize(), "Unconventional::CoverageStubs");
+			}
+
+			Data(const Data&) = delete;
+			Data& operator=(const Data&) = delete;
+
+			~Data()
+			{
+				SymbolMap::Unregister(stubsAddress);
+				ExecutableMemory::Free(stubsAddress, GetStubsSize());
+			}
+
+			size_t GetStubsSize() const
+			{
+				return (std::max)(probeCount, (size_t)1) * STUB_SIZE;
+			}
+		};
+
+		// Puts the original bytes back right away, but frees the stubs only once no thread can be in them
+		struct DataRetirer
+		{
+			void operator()(Data* data) const
+			{
+				for (size_t i = 0; i < data->probeCount; i++)
+					Disarm(&data->probes[i]);
+
+				Reclaimer::Retire({ { data->stubsAddress, data->GetStubsSize() } }, [data]() { delete data; });
+			}
+		};
+
+		std::unique_ptr<Data, DataRetirer> data;
+
+		static size_t GetHitWordCount(const size_t probeCount)
+		{
+			return (probeCount + 31) / 32;
+		}
+
+		// Restores the original bytes once, however many threads get here at the same time. Returns when they are in place.
+		// A probe still being armed is waited for and then disarmed.
+		static void Disarm(ProbeRecord* probe)
+		{
+			while (true)
+			{
+				uint32_t expected = ARMED;
+				if (probe->state.compare_exchange_strong(expected, RESTORING, std::memory_order_acq_rel))
+				{
+					Utils::WritePatch(probe->functionAddress, probe->originalBytes.data());
+					probe->state.store(DISARMED, std::memory_order_release);
+					return;
+				}
+
+				if (expected == DISARMED)
+					return;
+
+				YieldProcessor();
+			}
+		}
+
+		// Called by the handler on a hit. Returns where to continue: the function itself.
+		static uintptr_t __cdecl OnHit(ProbeRecord* probe)
+		{
+			probe->hitWord->fetch_or(probe->hitMask, std::memory_order_relaxed);
+			Disarm(probe);
+			return probe->functionAddress;
+		}
+
+		// Shared by all probes: counts itself as a hook call so the probe's data outlives it, then calls OnHit
+		// and "returns" into the function by overwriting the probe pushed by the stub with the function's address
+		static uintptr_t GetHandler()
+		{
+			static const uintptr_t handlerAddress = []()
+			{
+				constexpr uint32_t MAX_HANDLER_CODE_SIZE = 128;
+				const auto address = ExecutableMemory::Allocate(MAX_HANDLER_CODE_SIZE);
+
+				std::vector<uint8_t> bytes;
+
+				// pushad
+				bytes.push_back(0x60);
+				Reclaimer::AppendEnter(bytes, address);
+
+				// push dword ptr [esp + 32]; call OnHit; add esp, 4
+				bytes.insert(bytes.end(), { 0xFF, 0x74, 0x24, 0x20 });
+				Utils::AppendRelative(bytes, 0xE8, address, (uintptr_t)&OnHit);
+				bytes.insert(bytes.end(), { 0x83, 0xC4, 0x04 });
+
+				// mov [esp + 32], eax
+				bytes.insert(bytes.end(), { 0x89, 0x44, 0x24, 0x20 });
+
+				Reclaimer::AppendLeave(bytes);
+
+				// popad; ret
+				bytes.push_back(0x61);
+				bytes.push_back(0xC3);
+
+				if (bytes.size() > MAX_HANDLER_CODE_SIZE)
+					throw std::logic_error("Coverage handler byte size was larger than MAX_HANDLER_CODE_SIZE");
+
+				std::memcpy((void*)address, bytes.data(), bytes.size());
+				SymbolMap::Register(address, bytes.size(), "Unconventional::CoverageHandler");
+				return address;
+			}();
+			return handlerAddress;
+		}
+	};
+
+	// Byte pattern in the usual "8B 45 ? ? E8" notation, where '?' (or '??') matches any byte
+	class Pattern
+	{
+	public:
+		Pattern(const std::string& signature) : signature(signature)
+		{
+			for (size_t i = 0; i < signature.size();)
+			{
+				if (signature[i] == ' ')
+				{
+					i++;
+				}
+				else if (signature[i] == '?')
+				{
+					bytes.push_back(0);
+					mask.push_back(false);
+					i += (i + 1 < signature.size() && signature[i + 1] == '?') ? 2 : 1;
+				}
+				else
+				{
+					// Every byte token must be exactly two hex digits, otherwise "8 BB" would silently become 08 BB
+					if (i + 1 >= signature.size() || !std::isxdigit((uint8_t)signature[i]) || !std::isxdigit((uint8_t)signature[i + 1]) || (i + 2 < signature.size() && signature[i + 2] != ' '))
+						throw std::invalid_argument("Pattern contains a malformed byte");
+
+					bytes.push_back((uint8_t)std::stoul(signature.substr(i, 2), nullptr, 16));
+					mask.push_back(true);
+					i += 2;
+				}
+			}
+
+			anchorIndex = std::find(mask.begin(), mask.end(), true) - mask.begin();
+			if (anchorIndex == mask.size())
+				throw std::invalid_argument("Pattern needs at least one non-wildcard byte");
+		}
+
+		const std::string& GetSignature() const { return signature; }
+		size_t GetSize() const { return bytes.size(); }
+		uint64_t GetHash() const { return Utils::Hash(signature.data(), signature.size()); }
+
+		bool Matches(const uintptr_t address) const
+		{
+			for (size_t i = 0; i < bytes.size(); i++)
+			{
+				if (mask[i] && ((const uint8_t*)address)[i] != bytes[i])
+					return false;
+			}
+			return true;
+		}
+
+		// Returns the first match in [start, start + size) or 0
+		uintptr_t Find(const uintptr_t start, const size_t size) const
+		{
+			if (size < bytes.size())
+				return 0;
+
+			const auto* current = (const uint8_t*)start + anchorIndex;
+			const auto* end = (const uint8_t*)start + size - bytes.size() + anchorIndex + 1;
+			while (current < end)
+			{
+				current = (const uint8_t*)std::memchr(current, bytes[anchorIndex], end - current);
+				if (current == nullptr)
+					return 0;
+
+				const auto candidate = (uintptr_t)current - anchorIndex;
+				if (Matches(candidate))
+					return candidate;
+
+				current++;
+			}
+			return 0;
+		}
+
+	private:
+		std::string signature;
+		std::vector<uint8_t> bytes;
+		std::vector<bool> mask;
+		size_t anchorIndex;
+	};
+
+	// Identifies one particular build of a module, so cached results can be thrown away once it changes
+	struct ModuleIdentity
+	{
+		uint64_t nameHash;
+		uint32_t timeDateStamp;
+		uint32_t checkSum;
+		uint32_t sizeOfImage;
+
+		static ModuleIdentity Of(HMODULE module)
+		{
+			const auto* ntHeaders = ModuleUtils::GetNtHeaders(module);
+
+			char path[MAX_PATH];
+			const DWORD length = GetModuleFileNameA(module, path, MAX_PATH);
+			std::string name(path, length);
+			name = name.substr(name.find_last_of("\\/") + 1);
+			std::transform(name.begin(), name.end(), name.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c; });
+
+			return ModuleIdentity{
+				Utils::Hash(name.data(), name.size()),
+				ntHeaders->FileHeader.TimeDateStamp,
+				ntHeaders->OptionalHeader.CheckSum,
+				ntHeaders->OptionalHeader.SizeOfImage
+			};
+		}
+
+		bool operator==(const ModuleIdentity& other) const
+		{
+			return nameHash == other.nameHash && timeDateStamp == other.timeDateStamp && checkSum == other.checkSum && sizeOfImage == other.sizeOfImage;
+		}
+	};
+
+	// Persistent pattern -> RVA cache. The file is memory mapped and looked up in place,
+	// so only patterns that are missing or belong to a changed module build get rescanned.
+	class AddressCache
+	{
+	public:
+		struct Statistics
+		{
+			uint32_t hits;
+			uint32_t misses;
+		};
+
+		AddressCache(const std::string& path) : path(path), fileHandle(INVALID_HANDLE_VALUE), mappingHandle(nullptr), mappedEntries(nullptr), mappedEntryCount(0), isDirty(false), statistics{}
+		{
+			Map();
+		}
+
+		AddressCache(const AddressCache&) = delete;
+		AddressCache& operator=(const AddressCache&) = delete;
+
+		~AddressCache()
+		{
+			try
+			{
+				Save();
+			}
+			catch (...)
+			{
+			}
+
+			Unmap();
+		}
+
+		uintptr_t Resolve(HMODULE module, const Pattern& pattern)
+		{
+			const auto base = (uintptr_t)module;
+			const auto identity = GetIdentity(module);
+			const auto key = GetKey(identity, pattern);
+
+			auto newEntry = newEntries.find(key);
+			if (newEntry != newEntries.end() && IsValid(newEntry->second, identity, base, pattern))
+			{
+				statistics.hits++;
+				return base + newEntry->second.rva;
+			}
+
+			const auto* mappedEntry = FindMappedEntry(key);
+			if (mappedEntry != nullptr && IsValid(*mappedEntry, identity, base, pattern))
+			{
+				statistics.hits++;
+				return base + mappedEntry->rva;
+			}
+
+			statistics.misses++;
+
+			const auto address = Scan(module, pattern);
+			if (address == 0)
+				throw std::runtime_error("Pattern " + pattern.GetSignature() + " was not found");
+
+			newEntries[key] = Entry{ key, identity.nameHash, identity.timeDateStamp, identity.checkSum, identity.sizeOfImage, (uint32_t)(address - base) };
+			isDirty = true;
+
+			return address;
+		}
+
+		// Writes all valid entries back to disk; entries of modules whose build changed are dropped
+		void Save()
+		{
+			if (!isDirty)
+				return;
+
+			std::vector<Entry> entries;
+			entries.reserve(mappedEntryCount + newEntries.size());
+			for (uint32_t i = 0; i < mappedEntryCount; i++)
+			{
+				const auto& entry = mappedEntries[i];
+				const auto module = seenModules.find(entry.moduleNameHash);
+				if (newEntries.count(entry.key) == 0 && (module == seenModules.end() || entry.Matches(module->second)))
+					entries.push_back(entry);
+			}
+			for (const auto& [key, entry] : newEntries)
+			{
+				entries.push_back(entry);
+			}
+			std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.key < b.key; });
+
+			Unmap();
+
+			{
+				std::ofstream file(path, std::ios::binary | std::ios::trunc);
+				if (!file)
+					throw std::runtime_error("Could not open address cache file " + path + " for writing");
+
+				const Header header{ FILE_MAGIC, FILE_VERSION, (uint32_t)entries.size(), 0 };
+				file.write((const char*)&header, sizeof(header));
+				file.write((const char*)entries.data(), entries.size() * sizeof(Entry));
+			}
+
+			newEntries.clear();
+			isDirty = false;
+
+			Map();
+		}
+
+		Statistics GetStatistics() const { return statistics; }
+
+	private:
+		struct Header
+		{
+			uint32_t magic;
+			uint32_t version;
+			uint32_t entryCount;
+			uint32_t reserved;
+		};
+
+		struct Entry
+		{
+			uint64_t key;
+			uint64_t moduleNameHash;
+			uint32_t timeDateStamp;
+			uint32_t checkSum;
+			uint32_t sizeOfImage;
+			uint32_t rva;
+
+			bool Matches(const ModuleIdentity& identity) const
+			{
+				return moduleNameHash == identity.nameHash && timeDateStamp == identity.timeDateStamp && checkSum == identity.checkSum && sizeOfImage == identity.sizeOfImage;
+			}
+		};
+
+		static constexpr uint32_t FILE_MAGIC = 0x43414355; // "UCAC"
+		static constexpr uint32_t FILE_VERSION = 1;
+
+		std::string path;
+		HANDLE fileHandle;
+		HANDLE mappingHandle;
+		const Entry* mappedEntries;
+		uint32_t mappedEntryCount;
+
+		std::unordered_map<uint64_t, Entry> newEntries;
+		std::unordered_map<HMODULE, ModuleIdentity> identities;
+		std::unordered_map<uint64_t, ModuleIdentity> seenModules;
+		bool isDirty;
+
+		Statistics statistics;
+
+		// The rva comes from disk, so it is bounds checked against the image before the pattern is read there
+		static bool IsValid(const Entry& entry, const ModuleIdentity& identity, const uintptr_t base, const Pattern& pattern)
+		{
+			return entry.Matches(identity) && (uint64_t)entry.rva + pattern.GetSize() <= identity.sizeOfImage && pattern.Matches(base + entry.rva);
+		}
+
+		void Map()
+		{
+			fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (fileHandle == INVALID_HANDLE_VALUE)
+				return;
+
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(Header))
+			{
+				Unmap();
+				return;
+			}
+
+			mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			const auto* header = mappingHandle != nullptr ? (const Header*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if (header == nullptr)
+			{
+				Unmap();
+				return;
+			}
+
+			mappedEntries = (const Entry*)(header + 1);
+
+			// A cache from an older or corrupted version is treated as empty and rewritten on the next Save
+			if (header->magic != FILE_MAGIC || header->version != FILE_VERSION || fileSize.QuadPart < (LONGLONG)(sizeof(Header) + (uint64_t)header->entryCount * sizeof(Entry)))
+			{
+				Unmap();
+				isDirty = true;
+				return;
+			}
+
+			mappedEntryCount = header->entryCount;
+		}
+
+		void Unmap()
+		{
+			if (mappedEntries != nullptr)
+				UnmapViewOfFile((const Header*)mappedEntries - 1);
+			if (mappingHandle != nullptr)
+				CloseHandle(mappingHandle);
+			if (fileHandle != INVALID_HANDLE_VALUE)
+				CloseHandle(fileHandle);
+
+			fileHandle = INVALID_HANDLE_VALUE;
+			mappingHandle = nullptr;
+			mappedEntries = nullptr;
+			mappedEntryCount = 0;
+		}
+
+		const Entry* FindMappedEntry(const uint64_t key) const
+		{
+			const auto* end = mappedEntries + mappedEntryCount;
+			const auto* entry = std::lower_bound(mappedEntries, end, key, [](const Entry& a, uint64_t b) { return a.key < b; });
+			return entry != end && entry->key == key ? entry : nullptr;
+		}
+
+		const ModuleIdentity& GetIdentity(HMODULE module)
+		{
+			auto identity = identities.find(module);
+			if (identity == identities.end())
+			{
+				identity = identities.emplace(module, ModuleIdentity::Of(module)).first;
+				seenModules.emplace(identity->second.nameHash, identity->second);
+			}
+			return identity->second;
+		}
+
+		static uint64_t GetKey(const ModuleIdentity& identity, const Pattern& pattern)
+		{
+			const uint64_t words[] = { identity.nameHash, identity.timeDateStamp, identity.checkSum, identity.sizeOfImage, pattern.GetHash() };
+			return Utils::Hash(words, sizeof(words));
+		}
+
+		static uintptr_t Scan(HMODULE module, const Pattern& pattern)
+		{
+			for (const auto& section : ModuleUtils::GetExecutableSections(module))
+			{
+				const auto address = pattern.Find(section.address, section.size);
+				if (address != 0)
+					return address;
+			}
+			return 0;
+		}
+	};
+
+	// Typed access to the memory of the current process, or of another one through a handle opened with
+	// PROCESS_VM_READ / PROCESS_VM_WRITE / PROCESS_VM_OPERATION
+	class ProcessMemory
+	{
+	public:
+		// Accesses the current process directly, without going through the kernel
+		ProcessMemory() : processHandle(nullptr), systemCallCount(0)
+		{
+		}
+
+		ProcessMemory(HANDLE processHandle) : processHandle(processHandle), systemCallCount(0)
+		{
+		}
+
+		bool IsLocal() const { return processHandle == nullptr; }
+
+		// Number of ReadProcessMemory and WriteProcessMemory calls issued so far
+		uint32_t GetSystemCallCount() const { return systemCallCount; }
+
+		bool TryReadBytes(const uintptr_t address, void* buffer, const size_t size)
+		{
+			if (IsLocal())
+			{
+				std::memcpy(buffer, (const void*)address, size);
+				return true;
+			}
+
+			systemCallCount++;
+			SIZE_T bytesRead = 0;
+			return ReadProcessMemory(processHandle, (LPCVOID)address, buffer, size, &bytesRead) && bytesRead == size;
+		}
+
+		void ReadBytes(const uintptr_t address, void* buffer, const size_t size)
+		{
+			if (!TryReadBytes(address, buffer, size))
+				throw std::runtime_error("Could not read process memory");
+		}
+
+		bool TryWriteBytes(const uintptr_t address, const void* buffer, const size_t size)
+		{
+			if (IsLocal())
+			{
+				std::memcpy((void*)address, buffer, size);
+				return true;
+			}
+
+			systemCallCount++;
+			SIZE_T bytesWritten = 0;
+			return WriteProcessMemory(processHandle, (LPVOID)address, buffer, size, &bytesWritten) && bytesWritten == size;
+		}
+
+		void WriteBytes(const uintptr_t address, const void* buffer, const size_t size)
+		{
+			if (!TryWriteBytes(address, buffer, size))
+				throw std::runtime_error("Could not write process memory");
+		}
+
+		template<typename T>
+		T Read(const uintptr_t address)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be read from memory");
+
+			T value;
+			ReadBytes(address, &value, sizeof(T));
+			return value;
+		}
+
+		template<typename T>
+		void Write(const uintptr_t address, const T& value)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be written to memory");
+
+			WriteBytes(address, &value, sizeof(T));
+		}
+
+	private:
+		HANDLE processHandle;
+		uint32_t systemCallCount;
+	};
+
+	// Return values of the calls sent to a remote process in one round trip
+	struct RemoteBatch
+	{
+		std::vector<uint32_t> returnValues;
+		bool isDone = false;
+	};
+
+	// The result of a call queued with RemoteProcess::Enqueue, available once the batch it belongs to has been flushed
+	template<typename ReturnType>
+	class RemoteResult
+	{
+	public:
+		RemoteResult(std::shared_ptr<const RemoteBatch> batch, const uint32_t index) : batch(std::move(batch)), index(index)
+		{
+		}
+
+		bool IsReady() const { return batch->isDone; }
+
+		ReturnType Get() const
+		{
+			if (!batch->isDone)
+			{
+				throw std::logic_error("Remote call has not been flushed yet");
+			}
+
+			const uint32_t returnValue = batch->returnValues[index];
+			return *(ReturnType*)&returnValue;
+		}
+
+	private:
+		std::shared_ptr<const RemoteBatch> batch;
+		uint32_t index;
+	};
+
+	// Calls functions inside another process. A helper thread is parked in the target, waiting on an event. Queued calls
+	// are compiled into one block of code, and a flush writes it over, wakes the helper and reads all return values back.
+	// The handle needs PROCESS_CREATE_THREAD, PROCESS_DUP_HANDLE and PROCESS_VM_OPERATION / _READ / _WRITE access.
+	// The target has to be a 32-bit process of the same session, as the helper relies on kernel32 being mapped at the same address.
+	class RemoteProcess
+	{
+	public:
+		RemoteProcess(HANDLE processHandle)
+			: processHandle(processHandle), memory(processHandle), regionAddress(0), requestEvent(nullptr), doneEvent(nullptr),
+			  remoteRequestEvent(nullptr), remoteDoneEvent(nullptr), helperThread(nullptr), roundTripCount(0), isBroken(false)
+		{
+			regionAddress = (uintptr_t)VirtualAllocEx(processHandle, nullptr, REGION_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+			if (regionAddress == 0)
+				throw std::runtime_error("Could not allocate memory in the remote process");
+
+			requestEvent = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+			doneEvent = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+			if (requestEvent == nullptr || doneEvent == nullptr
+				|| !DuplicateHandle(GetCurrentProcess(), requestEvent, processHandle, &remoteRequestEvent, 0, FALSE, DUPLICATE_SAME_ACCESS)
+				|| !DuplicateHandle(GetCurrentProcess(), doneEvent, processHandle, &remoteDoneEvent, 0, FALSE, DUPLICATE_SAME_ACCESS))
+			{
+				Release();
+				throw std::runtime_error("Could not share events with the remote process");
+			}
+
+			const auto helperLoop = CreateHelperLoop();
+			memory.WriteBytes(regionAddress, helperLoop.data(), helperLoop.size());
+
+			helperThread = CreateRemoteThread(processHandle, nullptr, 0, (LPTHREAD_START_ROUTINE)regionAddress, nullptr, 0, nullptr);
+			if (helperThread == nullptr)
+			{
+				Release();
+				throw std::runtime_error("Could not create the helper thread in the remote process");
+			}
+
+			StartBatch();
+		}
+
+		RemoteProcess(const RemoteProcess&) = delete;
+		RemoteProcess& operator=(const RemoteProcess&) = delete;
+
+		~RemoteProcess()
+		{
+			// If the flag can't be written, e.g. because the target has exited, the helper won't see it, so don't wait for it
+			bool isHelperExiting = false;
+			if (helperThread != nullptr)
+			{
+				const uint32_t isExiting = 1;
+				isHelperExiting = memory.TryWriteBytes(regionAddress + EXIT_FLAG_OFFSET, &isExiting, sizeof(isExiting));
+				if (isHelperExiting)
+					SetEvent(requestEvent);
+			}
+			Release(isHelperExiting ? CALL_TIMEOUT_MILLISECONDS : 0);
+		}
+
+		ProcessMemory& GetMemory() { return memory; }
+
+		// Number of times the helper thread was woken up
+		uint32_t GetRoundTripCount() const { return roundTripCount; }
+
+		template<typename Signature, typename ReturnType, typename... ArgumentTypes>
+		RemoteResult<ReturnType> Enqueue(const Function<Signature, ReturnType, ArgumentTypes...>& function, ArgumentTypes... arguments)
+		{
+			constexpr uint32_t argumentCount = sizeof...(arguments);
+			static_assert(Signature::GetArgumentLocations().size() == argumentCount, "Amount of argument locations does not match number of function arguments");
+			static_assert(!Signature::HasArgumentInRegister(Location::ST0), "Arguments in FPU registers are currently not supported");
+			static_assert(sizeof(ReturnType) <= sizeof(uint32_t), "Remote return values have to fit into 32 bits");
+
+			ThrowIfBroken();
+
+			const uint32_t integerArguments[argumentCount > 0 ? argumentCount : 1]{ *(std::uint32_t*)&arguments... };
+			constexpr auto argumentLocations = Signature::GetArgumentLocations();
+
+			std::vector<uint8_t> bytes;
+			const auto codeAddress = regionAddress + CODE_OFFSET + batchCode.size();
+
+			// pushad
+			bytes.push_back(0x60);
+
+			// push each stack argument, last one first
+			for (int32_t i = (int32_t)argumentCount - 1; i >= 0; i--)
+			{
+				if (argumentLocations[i] == Location::Stack)
+				{
+					bytes.push_back(0x68);
+					Utils::AppendUInt32(bytes, integerArguments[i]);
+				}
+			}
+
+			// mov reg, argument
+			for (uint32_t i = 0; i < argumentCount; i++)
+			{
+				if (argumentLocations[i] != Location::Stack)
+				{
+					bytes.push_back(0xB8 + LocationUtils::GetRegisterNumber(argumentLocations[i]));
+					Utils::AppendUInt32(bytes, integerArguments[i]);
+				}
+			}
+
+			// call function
+			Utils::AppendRelative(bytes, 0xE8, codeAddress, function.GetAddress());
+
+			// add esp, X
+			constexpr uint32_t stackArgumentCount = Signature::GetStackArgumentCount();
+			if constexpr (CallingConventionUtils::SpecifiesCallerCleanup(Signature::GetCallingConvention()) && stackArgumentCount > 0)
+			{
+				bytes.insert(bytes.end(), { 0x81, 0xC4 });
+				Utils::AppendUInt32(bytes, stackArgumentCount * 4);
+			}
+
+			if (batchCode.size() + bytes.size() + 16 > REGION_SIZE - CODE_OFFSET || currentBatch->returnValues.size() == MAX_BATCH_SIZE)
+			{
+				// A call that doesn't even fit into an empty batch never will
+				if (currentBatch->returnValues.empty())
+					throw std::length_error("Remote call does not fit into the code region");
+
+				// The call doesn't fit anymore. Its code is position dependent, so it is generated again for the next batch.
+				Flush();
+				return Enqueue(function, arguments...);
+			}
+
+			const auto index = (uint32_t)currentBatch->returnValues.size();
+			const auto returnValueAddress = regionAddress + RETURN_VALUES_OFFSET + 4 * index;
+			if constexpr (Signature::GetReturnValueLocation() == Location::ST0)
+			{
+				// fstp dword ptr [returnValue]
+				bytes.insert(bytes.end(), { 0xD9, 0x1D });
+				Utils::AppendUInt32(bytes, returnValueAddress);
+			}
+			else
+			{
+				static_assert(Signature::GetReturnValueLocation() == Location::EAX, "Remote return values have to be in EAX or ST0");
+
+				// mov [returnValue], eax
+				bytes.push_back(0xA3);
+				Utils::AppendUInt32(bytes, returnValueAddress);
+			}
+
+			// popad
+			bytes.push_back(0x61);
+
+			batchCode.insert(batchCode.end(), bytes.begin(), bytes.end());
+			currentBatch->returnValues.push_back(0);
+			return RemoteResult<ReturnType>(currentBatch, index);
+		}
+
+		// Runs all queued calls in one round trip
+		void Flush()
+		{
+			ThrowIfBroken();
+
+			if (currentBatch->returnValues.empty())
+				return;
+
+			batchCode.push_back(0xC3);
+			memory.WriteBytes(regionAddress + CODE_OFFSET, batchCode.data(), batchCode.size());
+			FlushInstructionCache(processHandle, (void*)(regionAddress + CODE_OFFSET), batchCode.size());
+
+			roundTripCount++;
+			SetEvent(requestEvent);
+			if (WaitForSingleObject(doneEvent, CALL_TIMEOUT_MILLISECONDS) != WAIT_OBJECT_0)
+			{
+				// The helper may still be running the batch, so neither its code nor its return values can be touched again
+				isBroken = true;
+				throw std::runtime_error("Remote calls did not finish in time");
+			}
+
+			auto& returnValues = currentBatch->returnValues;
+			memory.ReadBytes(regionAddress + RETURN_VALUES_OFFSET, returnValues.data(), returnValues.size() * sizeof(uint32_t));
+			currentBatch->isDone = true;
+
+			StartBatch();
+		}
+
+	private:
+		static constexpr size_t REGION_SIZE = 64 * 1024;
+		static constexpr size_t EXIT_FLAG_OFFSET = 0x40;
+		static constexpr size_t RETURN_VALUES_OFFSET = 0x80;
+		static constexpr size_t MAX_BATCH_SIZE = 1024;
+		static constexpr size_t CODE_OFFSET = RETURN_VALUES_OFFSET + 4 * MAX_BATCH_SIZE;
+		static constexpr DWORD CALL_TIMEOUT_MILLISECONDS = 10000;
+
+		HANDLE processHandle;
+		ProcessMemory memory;
+		uintptr_t regionAddress;
+
+		HANDLE requestEvent;
+		HANDLE doneEvent;
+		HANDLE remoteRequestEvent;
+		HANDLE remoteDoneEvent;
+		HANDLE helperThread;
+
+		std::shared_ptr<RemoteBatch> currentBatch;
+		std::vector<uint8_t> batchCode;
+		uint32_t roundTripCount;
+		bool isBroken;
+
+		void ThrowIfBroken() const
+		{
+			if (isBroken)
+				throw std::logic_error("Remote process can not be used anymore after a batch timed out");
+		}
+
+		void StartBatch()
+		{
+			currentBatch = std::make_shared<RemoteBatch>();
+			batchCode.clear();
+		}
+
+		// The helper thread's start routine: wait for a request, run the batch, signal completion, repeat until asked to exit
+		std::vector<uint8_t> CreateHelperLoop() const
+		{
+			const auto kernel32 = GetModuleHandleA("kernel32.dll");
+			const auto waitForSingleObject = (uintptr_t)GetProcAddress(kernel32, "WaitForSingleObject");
+			const auto setEvent = (uintptr_t)GetProcAddress(kernel32, "SetEvent");
+
+			std::vector<uint8_t> bytes;
+
+			// L1: push INFINITE; push requestEvent; mov eax, WaitForSingleObject; call eax
+			bytes.insert(bytes.end(), { 0x6A, 0xFF });
+			bytes.push_back(0x68);
+			Utils::AppendUInt32(bytes, (uintptr_t)remoteRequestEvent);
+			bytes.push_back(0xB8);
+			Utils::AppendUInt32(bytes, waitForSingleObject);
+			bytes.insert(bytes.end(), { 0xFF, 0xD0 });
+
+			// cmp dword ptr [isExiting], 0; jnz L2
+			bytes.insert(bytes.end(), { 0x83, 0x3D });
+			Utils::AppendUInt32(bytes, regionAddress + EXIT_FLAG_OFFSET);
+			bytes.insert(bytes.end(), { 0x00, 0x75, 0x15 });
+
+			// mov eax, batchCode; call eax
+			bytes.push_back(0xB8);
+			Utils::AppendUInt32(bytes, regionAddress + CODE_OFFSET);
+			bytes.insert(bytes.end(), { 0xFF, 0xD0 });
+
+			// push doneEvent; mov eax, SetEvent; call eax
+			bytes.push_back(0x68);
+			Utils::AppendUInt32(bytes, (uintptr_t)remoteDoneEvent);
+			bytes.push_back(0xB8);
+			Utils::AppendUInt32(bytes, setEvent);
+			bytes.insert(bytes.end(), { 0xFF, 0xD0 });
+
+			// jmp L1
+			bytes.push_back(0xEB);
+			bytes.push_back((uint8_t)(0 - (bytes.size() + 1)));
+
+			// L2: xor eax, eax; ret 4
+			bytes.insert(bytes.end(), { 0x31, 0xC0, 0xC2, 0x04, 0x00 });
+
+			if (bytes.size() > EXIT_FLAG_OFFSET)
+				throw std::logic_error("Helper loop overlaps its data");
+
+			return bytes;
+		}
+
+		// Only frees the remote memory once the helper thread is known to be gone
+		void Release(const DWORD helperTimeoutMilliseconds = CALL_TIMEOUT_MILLISECONDS)
+		{
+			bool canFreeRegion = true;
+			if (helperThread != nullptr)
+			{
+				canFreeRegion = WaitForSingleObject(helperThread, helperTimeoutMilliseconds) == WAIT_OBJECT_0;
+				CloseHandle(helperThread);
+			}
+
+			for (const auto remoteEvent : { remoteRequestEvent, remoteDoneEvent })
+			{
+				if (remoteEvent != nullptr)
+					DuplicateHandle(processHandle, remoteEvent, nullptr, nullptr, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+			}
+
+			for (const auto event : { requestEvent, doneEvent })
+			{
+				if (event != nullptr)
+					CloseHandle(event);
+			}
+
+			if (canFreeRegion && regionAddress != 0)
+				VirtualFreeEx(processHandle, (void*)regionAddress, 0, MEM_RELEASE);
+		}
+	};
+
+	template<typename Signature, typename ReturnType, typename... ArgumentTypes>
+	ReturnType Function<Signature, ReturnType, ArgumentTypes...>::CallRemote(RemoteProcess& process, ArgumentTypes... arguments)
+	{
+		const auto result = process.Enqueue(*this, arguments...);
+		process.Flush();
+		return result.Get();
+	}
+
+	// A value found by following a pointer chain: every offset but the last is added to the address
+	// and dereferenced, the last one is added to give the address of the value. The walk is done once and cached.
+	template<typename T>
+	class Pointer
+	{
+	public:
+		Pointer(ProcessMemory& memory, const uintptr_t base, std::vector<uint32_t> offsets = {})
+			: memory(&memory), base(base), offsets(std::move(offsets)), resolvedAddress(0)
+		{
+		}
+
+		uintptr_t Resolve()
+		{
+			if (resolvedAddress == 0)
+			{
+				uintptr_t address = base;
+				for (size_t i = 0; i + 1 < offsets.size(); i++)
+				{
+					address = memory->Read<uintptr_t>(address + offsets[i]);
+					if (address == 0)
+						throw std::runtime_error("Pointer chain contains a null pointer");
+				}
+				resolvedAddress = offsets.empty() ? address : address + offsets.back();
+			}
+			return resolvedAddress;
+		}
+
+		// Call when one of the pointers along the chain may have changed
+		void Invalidate()
+		{
+			resolvedAddress = 0;
+		}
+
+		T Read()
+		{
+			return memory->Read<T>(Resolve());
+		}
+
+		void Write(const T& value)
+		{
+			memory->Write<T>(Resolve(), value);
+		}
+
+	private:
+		ProcessMemory* memory;
+		uintptr_t base;
+		std::vector<uint32_t> offsets;
+		uintptr_t resolvedAddress;
+	};
+
+	// Gathers many small reads and issues them as few large ones: requests are sorted by address,
+	// and those no more than MAX_GAP (4KB) bytes apart are served by a single ReadProcessMemory call.
+	// Nothing is merged across larger gaps, so truly scattered reads still cost one call each.
+	class ReadBatch
+	{
+	public:
+		ReadBatch(ProcessMemory& memory) : memory(&memory)
+		{
+		}
+
+		template<typename T>
+		void Add(const uintptr_t address, T* destination)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be read from memory");
+
+			requests.push_back({ address, sizeof(T), destination });
+		}
+
+		template<typename T>
+		void Add(Pointer<T>& pointer, T* destination)
+		{
+			Add(pointer.Resolve(), destination);
+		}
+
+		void Execute()
+		{
+			std::sort(requests.begin(), requests.end(), [](const Request& a, const Request& b) { return a.address < b.address; });
+
+			std::vector<uint8_t> buffer;
+			for (size_t first = 0; first < requests.size();)
+			{
+				const auto start = requests[first].address;
+				auto end = start + requests[first].size;
+
+				size_t last = first + 1;
+				while (last < requests.size() && requests[last].address <= end + MAX_GAP)
+				{
+					end = (std::max)(end, requests[last].address + requests[last].size);
+					last++;
+				}
+
+				buffer.resize(end - start);
+				if (memory->TryReadBytes(start, buffer.data(), buffer.size()))
+				{
+					for (size_t i = first; i < last; i++)
+					{
+						std::memcpy(requests[i].destination, buffer.data() + (requests[i].address - start), requests[i].size);
+					}
+				}
+				else
+				{
+					// The range may span unreadable pages between the requests, so fall back to reading them one by one
+					for (size_t i = first; i < last; i++)
+					{
+						memory->ReadBytes(requests[i].address, requests[i].destination, requests[i].size);
+					}
+				}
+
+				first = last;
+			}
+
+			requests.clear();
+		}
+
+	private:
+		struct Request
+		{
+			uintptr_t address;
+			size_t size;
+			void* destination;
+		};
+
+		static constexpr uintptr_t MAX_GAP = 4096;
+
+		ProcessMemory* memory;
+		std::vector<Request> requests;
 	};
 	
 }
\ No newline at end of file